@@ -0,0 +1,174 @@
+#!/usr/bin/env python3
+"""
+Benchmarks protoc-gen-php on a synthetic schema far larger than the test
+protos: thousands of messages with hundreds of fields each, nested several
+levels deep, with groups, enums, packed and repeated fields.
+
+The schema is written to a temporary directory, protoc is run once with the
+plugin, and the wall time, peak RSS and output size are written as JSON so
+that runs on successive commits can be compared.
+
+    bench/codegen.py --plugin ./protoc-gen-php --out bench-codegen.json
+"""
+
+import argparse
+import json
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+SCALARS = [
+    'double', 'float', 'int64', 'uint64', 'int32', 'fixed64', 'fixed32',
+    'bool', 'string', 'bytes', 'uint32', 'sfixed32', 'sfixed64', 'sint32',
+    'sint64',
+]
+
+PACKABLE = [t for t in SCALARS if t not in ('string', 'bytes')]
+
+
+def write_message(out, name, fields, depth, nesting, indent):
+    """Write message name and, nesting levels deep, one nested message per level."""
+    sp = '  ' * indent
+    out.append('%smessage %s {\n' % (sp, name))
+    out.append('%s  enum Kind { KIND_A = 0; KIND_B = 1; KIND_C = 200; }\n' % sp)
+
+    n = 1
+    if depth < nesting:
+        child = '%sL%d' % (name, depth + 1)
+        write_message(out, child, max(fields // 2, 4), depth + 1, nesting, indent + 1)
+        out.append('%s  optional %s child = %d;\n' % (sp, child, n))
+        out.append('%s  repeated %s children = %d;\n' % (sp, child, n + 1))
+        n += 2
+
+    out.append('%s  optional group Grp = %d {\n' % (sp, n))
+    out.append('%s    optional int32 a = %d;\n' % (sp, n + 1))
+    out.append('%s    repeated string b = %d;\n' % (sp, n + 2))
+    out.append('%s  }\n' % sp)
+    n += 3
+
+    for i in range(fields):
+        kind = i % 5
+        t = SCALARS[i % len(SCALARS)]
+        if kind == 0:
+            out.append('%s  required %s f%d = %d;\n' % (sp, t, i, n))
+        elif kind == 1:
+            out.append('%s  optional %s f%d = %d;\n' % (sp, t, i, n))
+        elif kind == 2:
+            out.append('%s  repeated %s f%d = %d;\n' % (sp, t, i, n))
+        elif kind == 3:
+            t = PACKABLE[i % len(PACKABLE)]
+            out.append('%s  repeated %s f%d = %d [packed = true];\n' % (sp, t, i, n))
+        else:
+            out.append('%s  optional Kind f%d = %d [default = KIND_C];\n' % (sp, i, n))
+        n += 1
+
+    out.append('%s}\n' % sp)
+
+
+def write_schema(directory, files, messages, fields, nesting):
+    """Write files .proto files of messages top level messages each, return their names."""
+    names = []
+    for f in range(files):
+        name = 'bench%03d.proto' % f
+        out = ['syntax = "proto2";\n', 'package bench%03d;\n\n' % f]
+        if f > 0:
+            out.append('import "bench%03d.proto";\n\n' % (f - 1))
+        for m in range(messages):
+            write_message(out, 'M%d' % m, fields, 0, nesting, 0)
+            if f > 0:
+                # Reference the previous file, so imports are exercised too
+                out.insert(-1, '  optional bench%03d.M%d imported = 100000;\n' % (f - 1, m))
+            out.append('\n')
+        with open(os.path.join(directory, name), 'w') as fp:
+            fp.write(''.join(out))
+        names.append(name)
+    return names
+
+
+def output_size(directory):
+    total, count = 0, 0
+    for root, _, filenames in os.walk(directory):
+        for filename in filenames:
+            total += os.path.getsize(os.path.join(root, filename))
+            count += 1
+    return total, count
+
+
+def git_commit():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'], stderr=subprocess.DEVNULL,
+                                       universal_newlines=True).strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n\n')[0])
+    parser.add_argument('--plugin', default='./protoc-gen-php')
+    parser.add_argument('--protoc', default='protoc')
+    parser.add_argument('--parameter', default='', help='the generator parameter, e.g. jobs=4')
+    parser.add_argument('--files', type=int, default=10)
+    parser.add_argument('--messages', type=int, default=100, help='top level messages per file')
+    parser.add_argument('--fields', type=int, default=100, help='fields per top level message')
+    parser.add_argument('--nesting', type=int, default=3, help='levels of nested messages')
+    parser.add_argument('--out', default='-', help='JSON results file, - for stdout')
+    args = parser.parse_args()
+
+    work = tempfile.mkdtemp(prefix='protoc-gen-php-bench.')
+    try:
+        src = os.path.join(work, 'src')
+        dst = os.path.join(work, 'out')
+        os.mkdir(src)
+        os.mkdir(dst)
+        protos = write_schema(src, args.files, args.messages, args.fields, args.nesting)
+
+        # Not --php_out, which newer protoc versions generate with their builtin PHP generator
+        out = dst if not args.parameter else args.parameter + ':' + dst
+        cmd = [args.protoc, '-I' + src, '--plugin=protoc-gen-bench=' + os.path.abspath(args.plugin),
+               '--bench_out=' + out] + protos
+
+        start = time.monotonic()
+        proc = subprocess.run(cmd, stderr=subprocess.PIPE, universal_newlines=True)
+        wall = time.monotonic() - start
+        if proc.returncode != 0:
+            sys.stderr.write(proc.stderr)
+            return 1
+
+        # ru_maxrss of the children is the largest of protoc and the plugin, in KiB on Linux
+        rss = resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss
+        size, count = output_size(dst)
+    finally:
+        shutil.rmtree(work)
+
+    top = args.files * args.messages
+    results = {
+        'commit': git_commit(),
+        'schema': {
+            'files': args.files,
+            'messages': top * (args.nesting + 1),
+            'top_level_messages': top,
+            'fields_per_message': args.fields,
+            'nesting': args.nesting,
+        },
+        'parameter': args.parameter,
+        'wall_seconds': round(wall, 3),
+        'peak_rss_kb': rss,
+        'output_bytes': size,
+        'output_files': count,
+    }
+
+    text = json.dumps(results, indent=2, sort_keys=True) + '\n'
+    if args.out == '-':
+        sys.stdout.write(text)
+    else:
+        with open(args.out, 'w') as fp:
+            fp.write(text)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,147 @@
+<?php
+/**
+ * The messages timed by bench/runtime.php and weighed by bench/memory.php.
+ * $gen is the directory the protos were generated into.
+ */
+
+require __DIR__ . '/../protocolbuffers.inc.php';
+require $gen . '/addressbook.proto.php';
+require $gen . '/bench/shapes.proto.php';
+
+function randomString($len)
+{
+    $s = '';
+    while (strlen($s) < $len) {
+        $s .= md5(mt_rand());
+    }
+    return substr($s, 0, $len);
+}
+
+function randomBytes($len)
+{
+    $s = '';
+    for ($i = 0; $i < $len; $i++) {
+        $s .= chr(mt_rand(0, 255));
+    }
+    return $s;
+}
+
+function scalars()
+{
+    $m = new Bench\Scalars();
+    $m->setDbl(3.14159);
+    $m->setFlt(2.5);
+    $m->setI64(-1234567890123);
+    $m->setU64(1234567890123);
+    $m->setI32(-123456);
+    $m->setFx64(98765432101);
+    $m->setFx32(123456789);
+    $m->setFlag(true);
+    $m->setU32(4000000000);
+    $m->setSfx32(-42);
+    $m->setSfx64(-4242424242);
+    $m->setS32(-300);
+    $m->setS64(-3000000000);
+    $m->setColor(Bench\Color::BLUE);
+    $m->setSmall(7);
+    $m->setTag('scalars');
+    return $m;
+}
+
+function strings()
+{
+    $m = new Bench\Strings();
+    $m->setTitle(randomString(100));
+    $m->setBody(randomString(64 * 1024));
+    $m->setData(randomBytes(16 * 1024));
+    return $m;
+}
+
+function deep($depth)
+{
+    $m = null;
+    for ($i = 0; $i < $depth; $i++) {
+        $node = new Bench\Node();
+        $node->setValue($i);
+        $node->setLabel('node' . $i);
+        if ($m !== null) {
+            $node->setChild($m);
+        }
+        $m = $node;
+    }
+    return $m;
+}
+
+function wide()
+{
+    $m = new Bench\Wide();
+    for ($i = 0; $i < 10000; $i++) {
+        $m->addInts(mt_rand(-1000000, 1000000));
+    }
+    for ($i = 0; $i < 2000; $i++) {
+        $m->addDoubles(mt_rand() / mt_getrandmax());
+    }
+    for ($i = 0; $i < 2000; $i++) {
+        $m->addIds(mt_rand());
+    }
+    for ($i = 0; $i < 1000; $i++) {
+        $m->addNames(randomString(mt_rand(1, 32)));
+    }
+    for ($i = 0; $i < 500; $i++) {
+        $item = new Bench\Item();
+        $item->setId($i);
+        $item->setName(randomString(16));
+        $m->addItems($item);
+    }
+    return $m;
+}
+
+function track()
+{
+    $m = new Bench\Track();
+    for ($i = 0; $i < 5000; $i++) {
+        $point = new Bench\Point();
+        $point->setLat(mt_rand(-90000000, 90000000) / 1e6);
+        $point->setLng(mt_rand(-180000000, 180000000) / 1e6);
+        $point->setTime(1500000000 + $i);
+        $point->setValid($i % 7 != 0);
+        $m->addPoints($point);
+    }
+    return $m;
+}
+
+function addressBook()
+{
+    $m = new AddressBook();
+    for ($i = 0; $i < 100; $i++) {
+        $person = new Person();
+        $person->setName(randomString(20));
+        $person->setId($i);
+        $person->setEmail(randomString(10) . '@example.com');
+        for ($j = 0; $j < 3; $j++) {
+            $phone = new PhoneNumber();
+            $phone->setNumber('+1 555 ' . mt_rand(1000000, 9999999));
+            $phone->setType($j);
+            $person->addPhone($phone);
+        }
+        $m->addPerson($person);
+    }
+    return $m;
+}
+
+/**
+ * One message of each shape, built the same way on every run.
+ */
+function corpus()
+{
+    mt_srand(1);
+
+    return array(
+        'scalars'     => scalars(),
+        'strings'     => strings(),
+        'deep'        => deep(64),
+        'wide'        => wide(),
+        'track'       => track(),
+        'addressbook' => addressBook(),
+    );
+}
@@ -0,0 +1,163 @@
+<?php
+/**
+ * Measures the memory retained by the generated classes, and compares it with
+ * a baseline.
+ *
+ *   php bench/memory.php [--gen=DIR] [--baseline=FILE] [--update]
+ *                        [--threshold=0.10] [--large=500] [--json=FILE]
+ *
+ * For every generated message class it records the bytes retained by an
+ * empty instance, and for every shape of bench/corpus.php the bytes retained
+ * by a decoded message. It then reports the peak memory used to read a
+ * --large MB message from a file, 0 to skip it. The run fails when any
+ * footprint, or that peak, is more than --threshold larger than the baseline,
+ * or when there is no baseline, and --update replaces the baseline with this
+ * run instead.
+ */
+
+$options = getopt('', array('gen:', 'baseline:', 'update', 'threshold:', 'large:', 'json:'));
+$gen       = isset($options['gen']) ? $options['gen'] : __DIR__ . '/gen';
+$baseline  = isset($options['baseline']) ? $options['baseline'] : __DIR__ . '/memory-baseline.json';
+$update    = isset($options['update']);
+$threshold = isset($options['threshold']) ? (float)$options['threshold'] : 0.10;
+$large     = isset($options['large']) ? (int)$options['large'] : 500;
+
+ini_set('memory_limit', '-1');
+
+require __DIR__ . '/corpus.php';
+
+/**
+ * Returns the bytes retained by each of the $n values returned by $make.
+ */
+function retained($make, $n)
+{
+    // Allocate the slots first, so that only the values are counted
+    $keep = array_fill(0, $n, null);
+    gc_collect_cycles();
+    $before = memory_get_usage();
+    for ($i = 0; $i < $n; $i++) {
+        $keep[$i] = $make();
+    }
+    $after = memory_get_usage();
+
+    return (int)round(($after - $before) / $n);
+}
+
+/**
+ * Writes a Strings message whose body is $mb MB to a temporary file.
+ */
+function largeInput($mb)
+{
+    $file = tempnam(sys_get_temp_dir(), 'protobuf-bench');
+    $fp = fopen($file, 'wb');
+    $chunk = str_repeat(randomString(1024), 1024);
+    fwrite($fp, "\x12" . Protobuf::encodeVarint($mb * strlen($chunk)));
+    for ($i = 0; $i < $mb; $i++) {
+        fwrite($fp, $chunk);
+    }
+    fclose($fp);
+
+    return $file;
+}
+
+$classes = array();
+foreach (get_declared_classes() as $class) {
+    if (is_subclass_of($class, 'ProtobufMessage')) {
+        $classes[$class] = retained(function () use ($class) {
+            return new $class();
+        }, 1000);
+    }
+}
+ksort($classes);
+
+$decoded = array();
+foreach (corpus() as $shape => $message) {
+    $class = get_class($message);
+    $encoded = $message->serializeToString();
+    $decoded[$shape] = retained(function () use ($class, $encoded) {
+        return new $class($encoded);
+    }, 20);
+}
+
+foreach ($classes as $class => $bytes) {
+    printf("%-24s %8d bytes per empty instance\n", $class, $bytes);
+}
+foreach ($decoded as $shape => $bytes) {
+    printf("%-24s %8d bytes per decoded message\n", $shape, $bytes);
+}
+
+$run = array(
+    'php'       => PHP_VERSION,
+    'extension' => extension_loaded('protobuf_primitives'),
+    'classes'   => $classes,
+    'decoded'   => $decoded,
+);
+
+if ($large > 0) {
+    $file = largeInput($large);
+    gc_collect_cycles();
+    if (function_exists('memory_reset_peak_usage')) {
+        memory_reset_peak_usage();
+    }
+    $before = memory_get_usage();
+    $fp = fopen($file, 'rb');
+    $message = new Bench\Strings($fp);
+    fclose($fp);
+    $peak = memory_get_peak_usage() - $before;
+    $size = filesize($file);
+    unset($message);
+    unlink($file);
+
+    $run['large'] = array('input_bytes' => $size, 'peak_bytes' => $peak);
+    printf("%-24s %8.1f MB peak reading %d MB, %.2fx the input\n", 'large', $peak / 1e6, $large, $peak / $size);
+}
+
+if (isset($options['json'])) {
+    file_put_contents($options['json'], json_encode($run, JSON_PRETTY_PRINT) . "\n");
+}
+
+if ($update) {
+    file_put_contents($baseline, json_encode($run, JSON_PRETTY_PRINT) . "\n");
+    echo "Wrote $baseline\n";
+    exit(0);
+}
+
+if (!file_exists($baseline)) {
+    echo "FAILED: no baseline in $baseline, record one with `make bench-memory-baseline`\n";
+    exit(1);
+}
+
+$base = json_decode(file_get_contents($baseline), true);
+if ($base['php'] != $run['php']) {
+    echo "Warning: the baseline was recorded with PHP {$base['php']}\n";
+}
+
+// Name => array(bytes, bytes in the baseline)
+$footprints = array();
+foreach (array('classes', 'decoded') as $kind) {
+    foreach ($base[$kind] as $name => $expected) {
+        if (isset($run[$kind][$name])) {
+            $footprints[$name] = array($run[$kind][$name], $expected);
+        }
+    }
+}
+if (isset($base['large'], $run['large'])) {
+    // Scaled to the size of this run's input, the baseline may have used another --large
+    $expected = $base['large']['peak_bytes'] * $run['large']['input_bytes'] / $base['large']['input_bytes'];
+    $footprints['large'] = array($run['large']['peak_bytes'], (int)round($expected));
+}
+
+$failed = 0;
+foreach ($footprints as $name => $footprint) {
+    list($bytes, $expected) = $footprint;
+    if ($bytes > $expected * (1 + $threshold)) {
+        printf("REGRESSION %s: %d bytes, %.1f%% more than the baseline %d bytes\n",
+            $name, $bytes, 100 * ($bytes / max($expected, 1) - 1), $expected);
+        $failed++;
+    }
+}
+
+if ($failed) {
+    exit(1);
+}
+echo "No footprint grew beyond " . (100 * $threshold) . "% of the baseline\n";
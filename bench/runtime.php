@@ -0,0 +1,130 @@
+<?php
+/**
+ * Times decoding and encoding of messages of representative shapes with the
+ * generated code, and compares the results with a baseline.
+ *
+ *   php bench/runtime.php [--gen=DIR] [--baseline=FILE] [--update]
+ *                         [--tolerance=0.15] [--time=0.5] [--json=FILE]
+ *
+ * --gen is the directory the protos were generated into (see `make bench`).
+ * Every operation is repeated for at least --time seconds. The run fails when
+ * any operation is more than --tolerance slower than the baseline, or when
+ * there is no baseline, and --update replaces the baseline with this run
+ * instead.
+ */
+
+$options = getopt('', array('gen:', 'baseline:', 'update', 'tolerance:', 'time:', 'json:'));
+$gen       = isset($options['gen']) ? $options['gen'] : __DIR__ . '/gen';
+$baseline  = isset($options['baseline']) ? $options['baseline'] : __DIR__ . '/baseline.json';
+$update    = isset($options['update']);
+$tolerance = isset($options['tolerance']) ? (float)$options['tolerance'] : 0.15;
+$minTime   = isset($options['time']) ? (float)$options['time'] : 0.5;
+
+require __DIR__ . '/corpus.php';
+
+/**
+ * Calls $op until $minTime seconds have passed, returns the calls per second.
+ */
+function measure($op, $minTime)
+{
+    $op(); // Warm up
+    $n = 0;
+    $batch = 1;
+    $start = microtime(true);
+    do {
+        for ($i = 0; $i < $batch; $i++) {
+            $op();
+        }
+        $n += $batch;
+        $batch *= 2;
+        $elapsed = microtime(true) - $start;
+    } while ($elapsed < $minTime);
+
+    return $n / $elapsed;
+}
+
+$corpus = corpus();
+
+$results = array();
+foreach ($corpus as $shape => $message) {
+    $class = get_class($message);
+    $encoded = $message->serializeToString();
+    $len = strlen($encoded);
+
+    $stream = fopen('php://memory', 'r+b');
+    fwrite($stream, $encoded);
+
+    $ops = array(
+        'decode' => function () use ($class, $encoded) {
+            new $class($encoded);
+        },
+        'read' => function () use ($class, $stream) {
+            rewind($stream);
+            new $class($stream);
+        },
+        'encode' => function () use ($message) {
+            $message->serializeToString();
+        },
+        'write' => function () use ($message, $stream) {
+            rewind($stream);
+            $message->write($stream);
+        },
+    );
+
+    foreach ($ops as $name => $op) {
+        $rate = measure($op, $minTime);
+        $results[$shape][$name] = array(
+            'ops_per_sec' => round($rate, 1),
+            'mb_per_sec'  => round($rate * $len / 1e6, 3),
+        );
+        printf("%-12s %-7s %8d bytes %12.1f ops/s %10.3f MB/s\n", $shape, $name, $len, $rate, $rate * $len / 1e6);
+    }
+    fclose($stream);
+}
+
+$run = array(
+    'php'       => PHP_VERSION,
+    'extension' => extension_loaded('protobuf_primitives'),
+    'results'   => $results,
+);
+
+if (isset($options['json'])) {
+    file_put_contents($options['json'], json_encode($run, JSON_PRETTY_PRINT) . "\n");
+}
+
+if ($update) {
+    file_put_contents($baseline, json_encode($run, JSON_PRETTY_PRINT) . "\n");
+    echo "Wrote $baseline\n";
+    exit(0);
+}
+
+if (!file_exists($baseline)) {
+    echo "FAILED: no baseline in $baseline, record one with `make bench-baseline`\n";
+    exit(1);
+}
+
+$base = json_decode(file_get_contents($baseline), true);
+if ($base['extension'] != $run['extension']) {
+    echo "Warning: the baseline was recorded " . ($base['extension'] ? 'with' : 'without') . " the protobuf_primitives extension\n";
+}
+
+$failed = 0;
+foreach ($base['results'] as $shape => $ops) {
+    foreach ($ops as $name => $expected) {
+        if (!isset($results[$shape][$name])) {
+            continue;
+        }
+        $rate = $results[$shape][$name]['ops_per_sec'];
+        $change = $rate / $expected['ops_per_sec'] - 1;
+        if ($change < -$tolerance) {
+            printf("REGRESSION %s %s: %.1f ops/s, %.1f%% slower than the baseline %.1f ops/s\n",
+                $shape, $name, $rate, -100 * $change, $expected['ops_per_sec']);
+            $failed++;
+        }
+    }
+}
+
+if ($failed) {
+    exit(1);
+}
+echo "No regression beyond " . (100 * $tolerance) . "% of the baseline\n";
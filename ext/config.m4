@@ -0,0 +1,8 @@
+dnl config.m4 for the protobuf_primitives extension
+
+PHP_ARG_ENABLE(protobuf_primitives, whether to enable the native protobuf primitives,
+[  --enable-protobuf-primitives  Enable the native Protobuf:: primitives])
+
+if test "$PHP_PROTOBUF_PRIMITIVES" != "no"; then
+  PHP_NEW_EXTENSION(protobuf_primitives, protobuf_primitives.c, $ext_shared)
+fi
@@ -0,0 +1,12 @@
+/**
+ * Native versions of the Protobuf:: primitives, see protocolbuffers.inc.php
+ */
+#ifndef PHP_PROTOBUF_PRIMITIVES_H
+#define PHP_PROTOBUF_PRIMITIVES_H
+
+extern zend_module_entry protobuf_primitives_module_entry;
+#define phpext_protobuf_primitives_ptr &protobuf_primitives_module_entry
+
+#define PHP_PROTOBUF_PRIMITIVES_VERSION "0.1"
+
+#endif
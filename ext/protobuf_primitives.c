@@ -0,0 +1,978 @@
+/**
+ * Native versions of the Protobuf:: primitives, see protocolbuffers.inc.php
+ *
+ * Registers the ProtobufPrimitives class, which the Protobuf class extends.
+ * Every method behaves like its userland counterpart in
+ * protocolbuffers.inc.php, which is only declared when this extension is
+ * not loaded.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include "php.h"
+#include "ext/standard/info.h"
+#include "zend_exceptions.h"
+
+#include "php_protobuf_primitives.h"
+
+#ifndef ZEND_TRY_ASSIGN_REF_LONG
+#define ZEND_TRY_ASSIGN_REF_LONG(zv, lval) do { \
+        ZVAL_DEREF(zv); \
+        zval_ptr_dtor(zv); \
+        ZVAL_LONG(zv, lval); \
+    } while (0)
+#endif
+
+#define PB_MAX_VARINT_LEN 10
+
+static void pb_throw(const char *msg)
+{
+    zend_throw_exception(zend_ce_exception, msg, 0);
+}
+
+static const char *pb_wiretype_name(zend_long wire_type)
+{
+    switch (wire_type) {
+        case 0:
+            return "varint";
+        case 1:
+            return "64-bit";
+        case 2:
+            return "length-delimited";
+        case 3:
+            return "group start";
+        case 4:
+            return "group end";
+        case 5:
+            return "32-bit";
+        default:
+            return "unknown";
+    }
+}
+
+static void pb_throw_wiretype(const char *function, zend_long wire_type)
+{
+    zend_throw_exception_ex(zend_ce_exception, 0, "%s(%s): Unsupported wire_type",
+        function, pb_wiretype_name(wire_type));
+}
+
+/* Subtracts n from $limit, unless it is null. */
+static void pb_consume(zval *limit, zend_long n)
+{
+    zval *value;
+
+    if (limit == NULL) {
+        return;
+    }
+    value = limit;
+    ZVAL_DEREF(value);
+    if (Z_TYPE_P(value) == IS_NULL) {
+        return;
+    }
+    ZEND_TRY_ASSIGN_REF_LONG(limit, zval_get_long(value) - n);
+}
+
+static zend_long pb_get_pos(zval *pos)
+{
+    zval *value = pos;
+
+    ZVAL_DEREF(value);
+    return zval_get_long(value);
+}
+
+static size_t pb_encode_varint(uint64_t value, unsigned char *out)
+{
+    size_t len = 0;
+
+    while (value > 0x7F) {
+        out[len++] = (unsigned char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char) value;
+
+    return len;
+}
+
+static int pb_size_varint(uint64_t value)
+{
+    int len = 1;
+
+    while (value > 0x7F) {
+        value >>= 7;
+        len++;
+    }
+
+    return len;
+}
+
+/*
+ * Reads a varint from the stream. Returns the number of bytes read, which is
+ * 0 at the end of the stream. As in userland, a varint cut short by the end
+ * of the stream is an error: -1 is returned, with an exception thrown.
+ */
+static int pb_stream_read_varint(php_stream *stream, uint64_t *value)
+{
+    int len = 0;
+    int shift = 0;
+    int b;
+
+    *value = 0;
+    do {
+        b = php_stream_getc(stream);
+        if (b == EOF) {
+            if (len > 0) {
+                pb_throw("readVarint(): Error reading byte");
+                return -1;
+            }
+            break;
+        }
+        if (shift < 64) {
+            *value |= (uint64_t) (b & 0x7F) << shift;
+        }
+        shift += 7;
+        len++;
+    } while (b >= 0x80);
+
+    return len;
+}
+
+/*
+ * Reads a varint from buf at *pos and advances *pos past it.
+ * Returns FAILURE, with an exception thrown, when buf ends first.
+ */
+static int pb_string_read_varint(const unsigned char *buf, size_t buf_len, zend_long *pos, uint64_t *value)
+{
+    int shift = 0;
+    unsigned char b;
+
+    *value = 0;
+    do {
+        if (*pos < 0 || (size_t) *pos >= buf_len) {
+            pb_throw("readVarintFromString(): Unexpected end of buffer");
+            return FAILURE;
+        }
+        b = buf[(*pos)++];
+        if (shift < 64) {
+            *value |= (uint64_t) (b & 0x7F) << shift;
+        }
+        shift += 7;
+    } while (b >= 0x80);
+
+    return SUCCESS;
+}
+
+static int pb_stream_read_fixed(php_stream *stream, unsigned char *out, size_t len)
+{
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = php_stream_read(stream, (char *) out + got, len - got);
+        if (n <= 0) {
+            return FAILURE;
+        }
+        got += n;
+    }
+
+    return SUCCESS;
+}
+
+static uint64_t pb_load_le(const unsigned char *in, size_t len)
+{
+    uint64_t value = 0;
+    size_t i;
+
+    for (i = len; i > 0; i--) {
+        value = (value << 8) | in[i - 1];
+    }
+
+    return value;
+}
+
+static void pb_store_le(uint64_t value, unsigned char *out, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        out[i] = (unsigned char) (value & 0xFF);
+        value >>= 8;
+    }
+}
+
+static int pb_stream_write(php_stream *stream, const unsigned char *data, size_t len)
+{
+    if ((size_t) php_stream_write(stream, (const char *) data, len) != len) {
+        pb_throw("writeFixed(): Error writing bytes");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+static inline uint64_t pb_zigzag_encode(zend_long value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static inline zend_long pb_zigzag_decode(uint64_t value)
+{
+    return (zend_long) ((value >> 1) ^ (~(value & 1) + 1));
+}
+
+/* {{{ proto int ProtobufPrimitives::sizeVarint(int $i) */
+PHP_METHOD(ProtobufPrimitives, sizeVarint)
+{
+    zend_long i;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &i) == FAILURE) {
+        return;
+    }
+
+    RETURN_LONG(pb_size_varint((uint64_t) i));
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readVarint(resource $fp, int &$limit = null) */
+PHP_METHOD(ProtobufPrimitives, readVarint)
+{
+    zval *zfp, *limit = NULL;
+    php_stream *stream;
+    uint64_t value;
+    int len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|z", &zfp, &limit) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    len = pb_stream_read_varint(stream, &value);
+    if (len < 0) {
+        return;
+    }
+    if (len == 0) {
+        if (php_stream_eof(stream)) {
+            RETURN_FALSE;
+        }
+        pb_throw("readVarint(): Error reading byte");
+        return;
+    }
+    pb_consume(limit, len);
+
+    RETURN_LONG((zend_long) value);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::readVarintFromString(string $buf, int &$pos) */
+PHP_METHOD(ProtobufPrimitives, readVarintFromString)
+{
+    zend_string *buf;
+    zval *zpos;
+    zend_long pos;
+    uint64_t value;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "Sz", &buf, &zpos) == FAILURE) {
+        return;
+    }
+
+    pos = pb_get_pos(zpos);
+    if (pb_string_read_varint((const unsigned char *) ZSTR_VAL(buf), ZSTR_LEN(buf), &pos, &value) == FAILURE) {
+        return;
+    }
+    ZEND_TRY_ASSIGN_REF_LONG(zpos, pos);
+
+    RETURN_LONG((zend_long) value);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeVarint(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeVarint)
+{
+    zval *zfp;
+    php_stream *stream;
+    zend_long i;
+    unsigned char out[PB_MAX_VARINT_LEN];
+    size_t len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "rl", &zfp, &i) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    len = pb_encode_varint((uint64_t) i, out);
+    if ((size_t) php_stream_write(stream, (const char *) out, len) != len) {
+        pb_throw("writeVarint(): Error writing byte");
+        return;
+    }
+
+    RETURN_LONG(len);
+}
+/* }}} */
+
+/* {{{ proto string ProtobufPrimitives::encodeVarint(int $i) */
+PHP_METHOD(ProtobufPrimitives, encodeVarint)
+{
+    zend_long i;
+    unsigned char out[PB_MAX_VARINT_LEN];
+    size_t len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "l", &i) == FAILURE) {
+        return;
+    }
+
+    len = pb_encode_varint((uint64_t) i, out);
+    RETURN_STRINGL((const char *) out, len);
+}
+/* }}} */
+
+/*
+ * Reads a little endian value of len bytes from the stream. Returns FAILURE,
+ * with return_value set to false at the end of the stream.
+ */
+static int pb_read_fixed(INTERNAL_FUNCTION_PARAMETERS, size_t len, uint64_t *value)
+{
+    zval *zfp;
+    php_stream *stream;
+    unsigned char in[8];
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "r", &zfp) == FAILURE) {
+        return FAILURE;
+    }
+    php_stream_from_zval_no_verify(stream, zfp);
+    if (stream == NULL) {
+        return FAILURE;
+    }
+
+    if (pb_stream_read_fixed(stream, in, len) == FAILURE) {
+        RETVAL_FALSE;
+        return FAILURE;
+    }
+    *value = pb_load_le(in, len);
+
+    return SUCCESS;
+}
+
+#define PB_READ_FIXED(len, convert) \
+    uint64_t value; \
+    if (pb_read_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, len, &value) == FAILURE) { \
+        return; \
+    } \
+    convert;
+
+/* {{{ proto float|false ProtobufPrimitives::readDouble(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readDouble)
+{
+    double d;
+
+    PB_READ_FIXED(8, memcpy(&d, &value, 8); RETURN_DOUBLE(d))
+}
+/* }}} */
+
+/* {{{ proto float|false ProtobufPrimitives::readFloat(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readFloat)
+{
+    uint32_t u;
+    float f;
+
+    PB_READ_FIXED(4, u = (uint32_t) value; memcpy(&f, &u, 4); RETURN_DOUBLE(f))
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readUint64(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readUint64)
+{
+    PB_READ_FIXED(8, RETURN_LONG((zend_long) value))
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readInt64(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readInt64)
+{
+    PB_READ_FIXED(8, RETURN_LONG((zend_long) value))
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readUint32(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readUint32)
+{
+    PB_READ_FIXED(4, RETURN_LONG((zend_long) (uint32_t) value))
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readInt32(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, readInt32)
+{
+    PB_READ_FIXED(4, RETURN_LONG((zend_long) (int32_t) (uint32_t) value))
+}
+/* }}} */
+
+static void pb_read_zint(INTERNAL_FUNCTION_PARAMETERS)
+{
+    zval *zfp, *limit = NULL;
+    php_stream *stream;
+    uint64_t value;
+    int len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "r|z", &zfp, &limit) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    len = pb_stream_read_varint(stream, &value);
+    if (len < 0) {
+        return;
+    }
+    if (len == 0) {
+        RETURN_FALSE;
+    }
+    pb_consume(limit, len);
+
+    RETURN_LONG(pb_zigzag_decode(value));
+}
+
+/* {{{ proto int|false ProtobufPrimitives::readZint32(resource $fp, int &$limit = null) */
+PHP_METHOD(ProtobufPrimitives, readZint32)
+{
+    pb_read_zint(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+/* }}} */
+
+/* {{{ proto int|false ProtobufPrimitives::readZint64(resource $fp, int &$limit = null) */
+PHP_METHOD(ProtobufPrimitives, readZint64)
+{
+    pb_read_zint(INTERNAL_FUNCTION_PARAM_PASSTHRU);
+}
+/* }}} */
+
+/* Writes the low len bytes of value to the stream, little endian. */
+static void pb_write_fixed(INTERNAL_FUNCTION_PARAMETERS, size_t len, int is_double)
+{
+    zval *zfp;
+    php_stream *stream;
+    zval *zvalue;
+    unsigned char out[8];
+    uint64_t value;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "rz", &zfp, &zvalue) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    if (is_double && len == 8) {
+        double d = zval_get_double(zvalue);
+        memcpy(&value, &d, 8);
+    } else if (is_double) {
+        float f = (float) zval_get_double(zvalue);
+        uint32_t u;
+        memcpy(&u, &f, 4);
+        value = u;
+    } else {
+        value = (uint64_t) zval_get_long(zvalue);
+    }
+
+    pb_store_le(value, out, len);
+    if (pb_stream_write(stream, out, len) == FAILURE) {
+        return;
+    }
+
+    RETURN_LONG(len);
+}
+
+/* {{{ proto int ProtobufPrimitives::writeDouble(resource $fp, float $d) */
+PHP_METHOD(ProtobufPrimitives, writeDouble)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 8, 1);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeFloat(resource $fp, float $f) */
+PHP_METHOD(ProtobufPrimitives, writeFloat)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 4, 1);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeUint64(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeUint64)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 8, 0);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeInt64(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeInt64)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 8, 0);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeUint32(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeUint32)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 4, 0);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeInt32(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeInt32)
+{
+    pb_write_fixed(INTERNAL_FUNCTION_PARAM_PASSTHRU, 4, 0);
+}
+/* }}} */
+
+static void pb_write_zint(INTERNAL_FUNCTION_PARAMETERS, int bits)
+{
+    zval *zfp;
+    php_stream *stream;
+    zend_long i;
+    uint64_t value;
+    unsigned char out[PB_MAX_VARINT_LEN];
+    size_t len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "rl", &zfp, &i) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    if (bits == 32) {
+        value = ((uint64_t) i << 1) ^ (uint64_t) (i >> 31);
+    } else {
+        value = pb_zigzag_encode(i);
+    }
+    len = pb_encode_varint(value, out);
+    if ((size_t) php_stream_write(stream, (const char *) out, len) != len) {
+        pb_throw("writeVarint(): Error writing byte");
+        return;
+    }
+
+    RETURN_LONG(len);
+}
+
+/* {{{ proto int ProtobufPrimitives::writeZint32(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeZint32)
+{
+    pb_write_zint(INTERNAL_FUNCTION_PARAM_PASSTHRU, 32);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::writeZint64(resource $fp, int $i) */
+PHP_METHOD(ProtobufPrimitives, writeZint64)
+{
+    pb_write_zint(INTERNAL_FUNCTION_PARAM_PASSTHRU, 64);
+}
+/* }}} */
+
+/* {{{ proto int ProtobufPrimitives::skipVarint(resource $fp) */
+PHP_METHOD(ProtobufPrimitives, skipVarint)
+{
+    zval *zfp;
+    php_stream *stream;
+    uint64_t value;
+    int len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "r", &zfp) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    len = pb_stream_read_varint(stream, &value);
+    if (len < 0) {
+        return;
+    }
+
+    RETURN_LONG(len);
+}
+/* }}} */
+
+static int pb_stream_skip(php_stream *stream, zend_long len, zend_long wire_type)
+{
+    if (php_stream_seek(stream, len, SEEK_CUR) == -1) {
+        zend_throw_exception_ex(zend_ce_exception, 0, "skip(%s): Error seeking",
+            pb_wiretype_name(wire_type));
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/*
+ * Skips the current field of the stream. Returns the number of bytes
+ * skipped, or -1 with an exception thrown.
+ */
+static zend_long pb_stream_skip_field(php_stream *stream, zend_long wire_type)
+{
+    uint64_t value;
+    zend_long len;
+    int varlen;
+
+    switch (wire_type) {
+        case 0: /* varint */
+            return pb_stream_read_varint(stream, &value);
+
+        case 1: /* 64bit */
+            return pb_stream_skip(stream, 8, 1) == SUCCESS ? 8 : -1;
+
+        case 2: /* length delimited */
+            varlen = pb_stream_read_varint(stream, &value);
+            if (varlen < 0 || pb_stream_skip(stream, (zend_long) value, 2) == FAILURE) {
+                return -1;
+            }
+            return (zend_long) value + varlen;
+
+        case 3: /* Start group, skip up to the matching end group */
+            len = 0;
+            while (1) {
+                zend_long skipped;
+
+                varlen = pb_stream_read_varint(stream, &value);
+                if (varlen < 0) {
+                    return -1;
+                }
+                if (varlen == 0) {
+                    pb_throw("skip(group start): Unexpected end of stream");
+                    return -1;
+                }
+                len += varlen;
+                if ((value & 0x07) == 4) {
+                    return len;
+                }
+                skipped = pb_stream_skip_field(stream, value & 0x07);
+                if (skipped < 0) {
+                    return -1;
+                }
+                len += skipped;
+            }
+
+        case 5: /* 32bit */
+            return pb_stream_skip(stream, 4, 5) == SUCCESS ? 4 : -1;
+
+        default:
+            pb_throw_wiretype("skip", wire_type);
+            return -1;
+    }
+}
+
+/* {{{ proto int ProtobufPrimitives::skipField(resource $fp, int $wireType) */
+PHP_METHOD(ProtobufPrimitives, skipField)
+{
+    zval *zfp;
+    php_stream *stream;
+    zend_long wire_type, len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "rl", &zfp, &wire_type) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    len = pb_stream_skip_field(stream, wire_type);
+    if (len < 0) {
+        return;
+    }
+
+    RETURN_LONG(len);
+}
+/* }}} */
+
+/* Skips the current field of buf, returns FAILURE with an exception thrown. */
+static int pb_string_skip_field(const unsigned char *buf, size_t buf_len, zend_long *pos, zend_long wire_type)
+{
+    uint64_t value;
+
+    switch (wire_type) {
+        case 0: /* varint */
+            return pb_string_read_varint(buf, buf_len, pos, &value);
+
+        case 1: /* 64bit */
+            *pos += 8;
+            return SUCCESS;
+
+        case 2: /* length delimited */
+            if (pb_string_read_varint(buf, buf_len, pos, &value) == FAILURE) {
+                return FAILURE;
+            }
+            /* Also rejects lengths of 2^63 and more, which are negative as a zend_long */
+            if (value > buf_len - (size_t) *pos) {
+                pb_throw("Unexpected end of buffer");
+                return FAILURE;
+            }
+            *pos += (zend_long) value;
+            return SUCCESS;
+
+        case 3: /* Start group, skip up to the matching end group */
+            while (1) {
+                if (pb_string_read_varint(buf, buf_len, pos, &value) == FAILURE) {
+                    return FAILURE;
+                }
+                if ((value & 0x07) == 4) {
+                    return SUCCESS;
+                }
+                if (pb_string_skip_field(buf, buf_len, pos, value & 0x07) == FAILURE) {
+                    return FAILURE;
+                }
+            }
+
+        case 5: /* 32bit */
+            *pos += 4;
+            return SUCCESS;
+
+        default:
+            pb_throw_wiretype("skip", wire_type);
+            return FAILURE;
+    }
+}
+
+/* {{{ proto void ProtobufPrimitives::skipFieldFromString(string $buf, int &$pos, int $wireType) */
+PHP_METHOD(ProtobufPrimitives, skipFieldFromString)
+{
+    zend_string *buf;
+    zval *zpos;
+    zend_long pos, wire_type;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "Szl", &buf, &zpos, &wire_type) == FAILURE) {
+        return;
+    }
+
+    pos = pb_get_pos(zpos);
+    if (pb_string_skip_field((const unsigned char *) ZSTR_VAL(buf), ZSTR_LEN(buf), &pos, wire_type) == FAILURE) {
+        return;
+    }
+    ZEND_TRY_ASSIGN_REF_LONG(zpos, pos);
+}
+/* }}} */
+
+/* Returns up to len bytes from the current position of the stream, like fread(). */
+static void pb_stream_read_bytes(php_stream *stream, size_t len, zval *return_value)
+{
+    zend_string *data = zend_string_alloc(len, 0);
+    size_t got = 0;
+
+    while (got < len) {
+        ssize_t n = php_stream_read(stream, ZSTR_VAL(data) + got, len - got);
+        if (n <= 0) {
+            break;
+        }
+        got += n;
+    }
+    ZSTR_LEN(data) = got;
+    ZSTR_VAL(data)[got] = '\0';
+
+    RETURN_NEW_STR(data);
+}
+
+/* {{{ proto mixed ProtobufPrimitives::readField(resource $fp, int $wireType, int &$limit = null) */
+PHP_METHOD(ProtobufPrimitives, readField)
+{
+    zval *zfp, *limit = NULL;
+    php_stream *stream;
+    zend_long wire_type;
+    uint64_t value;
+    int len;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "rl|z", &zfp, &wire_type, &limit) == FAILURE) {
+        return;
+    }
+    php_stream_from_zval(stream, zfp);
+
+    switch (wire_type) {
+        case 0: /* varint */
+            len = pb_stream_read_varint(stream, &value);
+            if (len < 0) {
+                return;
+            }
+            if (len == 0) {
+                RETURN_FALSE;
+            }
+            pb_consume(limit, len);
+            RETURN_LONG((zend_long) value);
+
+        case 1: /* 64bit */
+            pb_consume(limit, 8);
+            pb_stream_read_bytes(stream, 8, return_value);
+            return;
+
+        case 2: /* length delimited */
+            len = pb_stream_read_varint(stream, &value);
+            if (len < 0) {
+                return;
+            }
+            pb_consume(limit, len + (zend_long) value);
+            pb_stream_read_bytes(stream, (size_t) value, return_value);
+            return;
+
+        case 5: /* 32bit */
+            pb_consume(limit, 4);
+            pb_stream_read_bytes(stream, 4, return_value);
+            return;
+
+        default:
+            pb_throw_wiretype("read_unknown", wire_type);
+            return;
+    }
+}
+/* }}} */
+
+/* {{{ proto mixed ProtobufPrimitives::readFieldFromString(string $buf, int &$pos, int $wireType) */
+PHP_METHOD(ProtobufPrimitives, readFieldFromString)
+{
+    zend_string *buf;
+    zval *zpos;
+    zend_long pos, wire_type, len;
+    uint64_t value;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(), "Szl", &buf, &zpos, &wire_type) == FAILURE) {
+        return;
+    }
+
+    pos = pb_get_pos(zpos);
+    switch (wire_type) {
+        case 0: /* varint */
+            if (pb_string_read_varint((const unsigned char *) ZSTR_VAL(buf), ZSTR_LEN(buf), &pos, &value) == FAILURE) {
+                return;
+            }
+            ZEND_TRY_ASSIGN_REF_LONG(zpos, pos);
+            RETURN_LONG((zend_long) value);
+
+        case 1: /* 64bit */
+            len = 8;
+            break;
+
+        case 2: /* length delimited */
+            if (pb_string_read_varint((const unsigned char *) ZSTR_VAL(buf), ZSTR_LEN(buf), &pos, &value) == FAILURE) {
+                return;
+            }
+            if (value > ZSTR_LEN(buf) - (size_t) pos) {
+                pb_throw("Unexpected end of buffer");
+                return;
+            }
+            len = (zend_long) value;
+            break;
+
+        case 5: /* 32bit */
+            len = 4;
+            break;
+
+        default:
+            pb_throw_wiretype("read_unknown", wire_type);
+            return;
+    }
+
+    /* Like substr(), clamp to the end of the buffer. */
+    if (pos < 0 || (size_t) pos >= ZSTR_LEN(buf)) {
+        RETVAL_EMPTY_STRING();
+    } else if ((size_t) (pos + len) > ZSTR_LEN(buf)) {
+        RETVAL_STRINGL(ZSTR_VAL(buf) + pos, ZSTR_LEN(buf) - pos);
+    } else {
+        RETVAL_STRINGL(ZSTR_VAL(buf) + pos, len);
+    }
+    ZEND_TRY_ASSIGN_REF_LONG(zpos, pos + len);
+}
+/* }}} */
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_int, 0, 0, 1)
+    ZEND_ARG_INFO(0, i)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_fp, 0, 0, 1)
+    ZEND_ARG_INFO(0, fp)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_fp_limit, 0, 0, 1)
+    ZEND_ARG_INFO(0, fp)
+    ZEND_ARG_INFO(1, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_fp_value, 0, 0, 2)
+    ZEND_ARG_INFO(0, fp)
+    ZEND_ARG_INFO(0, value)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_buf_pos, 0, 0, 2)
+    ZEND_ARG_INFO(0, buf)
+    ZEND_ARG_INFO(1, pos)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_fp_wire, 0, 0, 2)
+    ZEND_ARG_INFO(0, fp)
+    ZEND_ARG_INFO(0, wireType)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_fp_wire_limit, 0, 0, 2)
+    ZEND_ARG_INFO(0, fp)
+    ZEND_ARG_INFO(0, wireType)
+    ZEND_ARG_INFO(1, limit)
+ZEND_END_ARG_INFO()
+
+ZEND_BEGIN_ARG_INFO_EX(arginfo_pb_buf_pos_wire, 0, 0, 3)
+    ZEND_ARG_INFO(0, buf)
+    ZEND_ARG_INFO(1, pos)
+    ZEND_ARG_INFO(0, wireType)
+ZEND_END_ARG_INFO()
+
+#define PB_ME(name, arginfo) PHP_ME(ProtobufPrimitives, name, arginfo, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+
+static const zend_function_entry protobuf_primitives_methods[] = {
+    PB_ME(sizeVarint,           arginfo_pb_int)
+    PB_ME(readVarint,           arginfo_pb_fp_limit)
+    PB_ME(readVarintFromString, arginfo_pb_buf_pos)
+    PB_ME(readDouble,           arginfo_pb_fp)
+    PB_ME(readFloat,            arginfo_pb_fp)
+    PB_ME(readUint64,           arginfo_pb_fp)
+    PB_ME(readInt64,            arginfo_pb_fp)
+    PB_ME(readUint32,           arginfo_pb_fp)
+    PB_ME(readInt32,            arginfo_pb_fp)
+    PB_ME(readZint32,           arginfo_pb_fp_limit)
+    PB_ME(readZint64,           arginfo_pb_fp_limit)
+    PB_ME(writeVarint,          arginfo_pb_fp_value)
+    PB_ME(encodeVarint,         arginfo_pb_int)
+    PB_ME(writeDouble,          arginfo_pb_fp_value)
+    PB_ME(writeFloat,           arginfo_pb_fp_value)
+    PB_ME(writeUint64,          arginfo_pb_fp_value)
+    PB_ME(writeInt64,           arginfo_pb_fp_value)
+    PB_ME(writeUint32,          arginfo_pb_fp_value)
+    PB_ME(writeInt32,           arginfo_pb_fp_value)
+    PB_ME(writeZint32,          arginfo_pb_fp_value)
+    PB_ME(writeZint64,          arginfo_pb_fp_value)
+    PB_ME(skipVarint,           arginfo_pb_fp)
+    PB_ME(skipField,            arginfo_pb_fp_wire)
+    PB_ME(skipFieldFromString,  arginfo_pb_buf_pos_wire)
+    PB_ME(readField,            arginfo_pb_fp_wire_limit)
+    PB_ME(readFieldFromString,  arginfo_pb_buf_pos_wire)
+    PHP_FE_END
+};
+
+PHP_MINIT_FUNCTION(protobuf_primitives)
+{
+    zend_class_entry ce;
+
+    INIT_CLASS_ENTRY(ce, "ProtobufPrimitives", protobuf_primitives_methods);
+    zend_register_internal_class(&ce);
+
+    return SUCCESS;
+}
+
+PHP_MINFO_FUNCTION(protobuf_primitives)
+{
+    php_info_print_table_start();
+    php_info_print_table_header(2, "protobuf_primitives support", "enabled");
+    php_info_print_table_row(2, "Version", PHP_PROTOBUF_PRIMITIVES_VERSION);
+    php_info_print_table_end();
+}
+
+zend_module_entry protobuf_primitives_module_entry = {
+    STANDARD_MODULE_HEADER,
+    "protobuf_primitives",
+    NULL,
+    PHP_MINIT(protobuf_primitives),
+    NULL,
+    NULL,
+    NULL,
+    PHP_MINFO(protobuf_primitives),
+    PHP_PROTOBUF_PRIMITIVES_VERSION,
+    STANDARD_MODULE_PROPERTIES
+};
+
+#ifdef COMPILE_DL_PROTOBUF_PRIMITIVES
+ZEND_GET_MODULE(protobuf_primitives)
+#endif
@@ -3,23 +3,27 @@
  * By Andrew Brampton (c) 2010
  *
  * TODO
- *  Support the packed option
  *  Lots of optimisations
  *  Extensions
  *  Services
  *  Packages
  *  Better validation (add code to check setted values are valid)
- *  option optimize_for = CODE_SIZE/SPEED;
  */
 #include "strutil.h" // TODO This header is from the offical protobuf source, but it is not normally installed
 
 #include <map>
+#include <set>
 #include <string>
 #include <algorithm>
 
 #include <cstdio> // for sprintf
 
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h> // for sysconf
+
 #include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/wire_format.h>
 #include <google/protobuf/wire_format_lite.h>
 #include <google/protobuf/wire_format_lite_inl.h>
@@ -27,8 +31,10 @@
 #include <google/protobuf/compiler/plugin.h>
 #include <google/protobuf/compiler/code_generator.h>
 
+#include <google/protobuf/io/coded_stream.h>
 #include <google/protobuf/io/printer.h>
 #include <google/protobuf/io/zero_copy_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
 
 #include "php_options.pb.h"
 
@@ -38,10 +44,208 @@ using namespace google::protobuf::internal;
 
 const int STYLE_NB_SPACES = 4;
 
+// Part of the cache key. Bump it with every change to the generated code, so
+// that a newer plugin never reuses output cached by an older one.
+const char * const GENERATOR_VERSION = "protoc-gen-php 2";
+
+/**
+ * A Printer template, split once into the literal and variable segments of
+ * its lines. Printing it looks up the variables, but never scans the text
+ * again. `sp` is replaced by one level of indentation as it is parsed.
+ *
+ * The output is the same as io::Printer::Print() with the '`' delimiter,
+ * so the templates are kept as static locals and parsed on first use.
+ */
+class Template
+{
+    public:
+        explicit Template(const string & text);
+
+        void Print(io::Printer & printer, const map<string, string> & vars) const;
+
+    private:
+        enum SegmentType { LITERAL, VARIABLE, NEWLINE };
+
+        struct Segment
+        {
+            SegmentType type;
+            string text; // The literal, or the name of the variable
+        };
+
+        vector<Segment> segments_;
+};
+
+Template::Template(const string & text)
+{
+    const string indent (STYLE_NB_SPACES, ' ');
+    Segment literal = { LITERAL, "" };
+
+    for (size_t pos = 0; pos < text.size(); ++pos) {
+        if (text[pos] == '\n') {
+            if (!literal.text.empty()) {
+                segments_.push_back(literal);
+                literal.text.clear();
+            }
+            Segment newline = { NEWLINE, "" };
+            segments_.push_back(newline);
+
+        } else if (text[pos] == '`') {
+            size_t end = text.find('`', pos + 1);
+            if (end == string::npos) {
+                throw "Error: Unclosed variable name in template";
+            }
+
+            string name (text, pos + 1, end - pos - 1);
+            if (name.empty()) {
+                literal.text += '`'; // `` is a literal delimiter
+            } else if (name == "sp") {
+                literal.text += indent;
+            } else {
+                if (!literal.text.empty()) {
+                    segments_.push_back(literal);
+                    literal.text.clear();
+                }
+                Segment variable = { VARIABLE, name };
+                segments_.push_back(variable);
+            }
+            pos = end;
+
+        } else {
+            literal.text += text[pos];
+        }
+    }
+
+    if (!literal.text.empty()) {
+        segments_.push_back(literal);
+    }
+}
+
+/**
+ * Literals and values are written raw, so only the first one of a line is
+ * indented, and newlines go through Print() so the next line is.
+ */
+void Template::Print(io::Printer & printer, const map<string, string> & vars) const
+{
+    for (size_t i = 0; i < segments_.size(); ++i) {
+        const Segment & segment (segments_[i]);
+
+        switch (segment.type) {
+            case LITERAL:
+                printer.PrintRaw(segment.text);
+                break;
+
+            case VARIABLE: {
+                map<string, string>::const_iterator value = vars.find(segment.text);
+                if (value == vars.end()) {
+                    throw "Error: Undefined template variable";
+                }
+                printer.PrintRaw(value->second);
+                break;
+            }
+
+            case NEWLINE:
+                printer.Print("\n");
+                break;
+        }
+    }
+}
+
+// The commands decoding one field, in its normal and packed encodings.
+struct FieldReader
+{
+    const FieldDescriptor * field;
+    const Template * commands;
+    const Template * packed_commands;
+};
+
+// One case of the generated read loop.
+struct ReadCase
+{
+    uint32 tag;
+    const FieldDescriptor * field;
+    const Template * commands;
+    bool loop; // Decode back to back elements without leaving the case
+};
+
+// The options given to the plugin, e.g. --php_out=jobs=4:out
+struct GeneratorOptions
+{
+    GeneratorOptions() : jobs(0), psr4(false), preload(false), preload_runtime("protocolbuffers.inc.php") {}
+
+    int jobs; // Files generated at once by GenerateAll(), 0 for one per CPU
+    string cache_dir; // Where generated files are cached, if not empty
+    bool psr4; // One file per class, in directories named after the namespace
+    bool preload; // Write a preload.php for opcache.preload
+    string preload_runtime; // The protocolbuffers.inc.php preload.php requires
+
+    // The options which change the generated code, part of the cache key
+    string output_parameter;
+};
+
+// A file to write in the output directory.
+struct GeneratedFile
+{
+    string name;
+    string content;
+};
+
+// One file of GenerateAll(), rendered by whichever worker picks it up.
+struct GenerateJob
+{
+    const FileDescriptor * file;
+    vector<GeneratedFile> outputs;
+    string error;
+    bool ok;
+    bool cached; // The output came from the cache
+};
+
+class PHPCodeGenerator;
+
+// The work shared by the GenerateAll() workers.
+struct GeneratePool
+{
+    const PHPCodeGenerator * generator;
+    const GeneratorOptions * options;
+    vector<GenerateJob> * jobs;
+    size_t next; // The next job to pick up, guarded by lock
+    pthread_mutex_t lock;
+};
+
 class PHPCodeGenerator : public CodeGenerator
 {
     private:
+        bool ParseOptions(const string & parameter, GeneratorOptions * options, string * error) const;
+
+        // Render the PHP files of one .proto
+        bool GenerateFile(const FileDescriptor * file, const GeneratorOptions & options, vector<GeneratedFile> * outputs, string * error) const;
+
+        // Print the lines every generated file starts with
+        void PrintHeader(io::Printer &printer, const FileDescriptor & file, const string & filename) const;
+
+        // Render each class into its own file, and the .proto file into their autoloader
+        void GenerateClassFiles(const FileDescriptor & file, vector<GeneratedFile> * outputs) const;
+        void GenerateMessageFiles(const Descriptor & message, vector<GeneratedFile> * outputs) const;
+        void GenerateEnumFile(const EnumDescriptor & e, vector<GeneratedFile> * outputs) const;
+        void GenerateAutoloader(const FileDescriptor & file, vector<GeneratedFile> * outputs) const;
+
+        // The path of the file holding a class, relative to the output directory
+        template <class DescriptorType>
+        string ClassFilename(const DescriptorType & descriptor) const;
+
+        // The cache key of a file, a hash of everything its output depends on
+        string CacheKey(const FileDescriptor * file, const GeneratorOptions & options) const;
+
+        // GenerateFile(), through the cache when there is one
+        void GenerateJobOutput(GenerateJob & job, const GeneratorOptions & options) const;
+
+        // Render the opcache preload script of all the generated files
+        void GeneratePreload(const vector<GenerateJob> & jobs, const GeneratorOptions & options, GeneratedFile * output) const;
+
+        // Run the jobs of a GenerateAll() until none are left
+        static void * GenerateWorker(void * pool);
+
         void PrintMessage(io::Printer &printer, const Descriptor & message) const;
+        void PrintMessageClass(io::Printer &printer, const Descriptor & message) const;
         void PrintMessages(io::Printer &printer, const FileDescriptor & file) const;
 
         void PrintEnum(io::Printer &printer, const EnumDescriptor & e, bool is_last) const;
@@ -52,26 +256,50 @@ class PHPCodeGenerator : public CodeGenerator
 
         string DefaultValueAsString(const FieldDescriptor & field, bool quote_string_type) const;
 
+        // Print the loop decoding each field, shared by read() and mergeFromString()
+        void PrintReadLoop(io::Printer &printer, const FieldDescriptor * parentField, const vector<FieldReader> & readers, const Template & next, const Template & skip, const string & unknown) const;
+
         // Print the read() method
         void PrintMessageRead(io::Printer &printer, const Descriptor & message, vector<const FieldDescriptor *> & required_fields, const FieldDescriptor * parentField) const;
 
-        // Print the write() method
+        // Print the mergeFromString() method
+        void PrintMessageMergeFromString(io::Printer &printer, const Descriptor & message, const FieldDescriptor * parentField) const;
+
+        // Print the writeWithCachedSizes() method
         void PrintMessageWrite(io::Printer &printer, const Descriptor & message, const FieldDescriptor * parentField) const;
 
+        // Print the serializeWithCachedSizes() method
+        void PrintMessageSerialize(io::Printer &printer, const Descriptor & message) const;
+
         // Print the size() method
         void PrintMessageSize(io::Printer &printer, const Descriptor & message) const;
 
+        // Commands to read, write and size a packed repeated field
+        const Template & PackedReadCommands(const FieldDescriptor & field, bool from_string) const;
+        const Template & PackedWriteCommands(const FieldDescriptor & field) const;
+        const Template & PackedSizeCommands(const FieldDescriptor & field) const;
+
         // Map names into PHP names
         template <class DescriptorType>
         string ClassName(const DescriptorType & descriptor) const;
 
         string VariableName(const FieldDescriptor & field) const;
 
+        // Is this a sub-message whose decoding is deferred until first access
+        bool IsLazy(const FieldDescriptor & field) const;
+
+        // Are unknown fields skipped, instead of being kept in $unknown
+        bool SkipUnknown(const FileDescriptor & file) const;
+
+        // Print the static field table interpreted by the generic codec in ProtobufMessage
+        void PrintMessageFields(io::Printer &printer, const Descriptor & message) const;
+
     public:
         PHPCodeGenerator();
         ~PHPCodeGenerator();
 
         bool Generate(const FileDescriptor* file, const string& parameter, OutputDirectory* output_directory, string* error) const;
+        bool GenerateAll(const vector<const FileDescriptor*>& files, const string& parameter, OutputDirectory* output_directory, string* error) const;
 };
 
 PHPCodeGenerator::PHPCodeGenerator() {}
@@ -147,6 +375,27 @@ string PHPCodeGenerator::VariableName(const FieldDescriptor & field) const
     return UnderscoresToCamelCase(field);
 }
 
+/**
+ * Singular sub-messages marked with [lazy = true] keep their raw bytes when
+ * parsed, and are only decoded the first time they are accessed.
+ */
+bool PHPCodeGenerator::IsLazy(const FieldDescriptor & field) const
+{
+    return field.type() == FieldDescriptor::TYPE_MESSAGE
+        && !field.is_repeated()
+        && field.options().lazy();
+}
+
+/**
+ * The lite runtime never keeps unknown fields, they are only there to be
+ * printed or written back out.
+ */
+bool PHPCodeGenerator::SkipUnknown(const FileDescriptor & file) const
+{
+    return file.options().GetExtension(php).skip_unknown()
+        || file.options().optimize_for() == FileOptions::LITE_RUNTIME;
+}
+
 string PHPCodeGenerator::DefaultValueAsString(const FieldDescriptor & field, bool quote_string_type) const {
     switch (field.cpp_type()) {
         case FieldDescriptor::CPPTYPE_INT32:
@@ -188,90 +437,429 @@ string PHPCodeGenerator::DefaultValueAsString(const FieldDescriptor & field, boo
     return "";
 }
 
-void PHPCodeGenerator::PrintMessageRead(io::Printer &printer, const Descriptor & message, vector<const FieldDescriptor *> & required_fields, const FieldDescriptor * parentField) const
+/**
+ * Returns the commands decoding the varint at pos in the string buf into
+ * target. One and two byte varints, most tags, lengths and small numbers,
+ * are decoded inline, longer ones by Protobuf::readVarintFromString().
+ */
+string InlineVarintText(const string & target, const string & buf, const string & pos)
+{
+    return "if (isset(" + buf + "[" + pos + "]) && (" + target + " = ord(" + buf + "[" + pos + "])) < 0x80) {\n"
+           "`sp`" + pos + "++;\n"
+           "} elseif (isset(" + buf + "[" + pos + " + 1]) && ($b = ord(" + buf + "[" + pos + " + 1])) < 0x80) {\n"
+           "`sp`" + target + " = (" + target + " & 0x7F) | ($b << 7);\n"
+           "`sp`" + pos + " += 2;\n"
+           "} else {\n"
+           "`sp`" + target + " = Protobuf::readVarintFromString(" + buf + ", " + pos + ");\n"
+           "}";
+}
+
+// Indent every line of a template text by one level.
+string IndentText(const string & text)
+{
+    string result ("`sp`");
+    for (size_t i = 0; i < text.size(); ++i) {
+        result += text[i];
+        if (text[i] == '\n' && i + 1 < text.size()) {
+            result += "`sp`";
+        }
+    }
+    return result;
+}
+
+/**
+ * The pack() and unpack() format of the fixed width values of a packed
+ * repeated field, empty for varints.
+ */
+string PackedFormat(const FieldDescriptor & field)
+{
+    switch (field.type()) {
+        case FieldDescriptor::TYPE_DOUBLE:   return "e*";
+        case FieldDescriptor::TYPE_FLOAT:    return "g*";
+        case FieldDescriptor::TYPE_FIXED32:
+        case FieldDescriptor::TYPE_SFIXED32: return "V*";
+        case FieldDescriptor::TYPE_FIXED64:
+        case FieldDescriptor::TYPE_SFIXED64: return "P*";
+        default:                             return "";
+    }
+}
+
+/**
+ * Returns the size of the message on the wire when the schema alone decides
+ * it, that is when every field is required and either fixed width, a bool or
+ * such a message itself, otherwise -1.
+ *
+ * Enums are not fixed size, the decoders keep values outside of the enum as
+ * they are, and lazy fields write back their raw bytes as they were read.
+ *
+ * CODE_SIZE messages are sized by the generic codec, which caches the size
+ * of their sub-messages, so they never have a constant size.
+ */
+int EncodedSize(const Descriptor & message, int depth = 0)
+{
+    // A message can't require itself, don't follow such cycles
+    if (depth > 32 || message.extension_range_count() > 0
+            || message.file()->options().optimize_for() == FileOptions::CODE_SIZE) {
+        return -1;
+    }
+
+    int size = 0;
+    for (int i = 0; i < message.field_count(); ++i) {
+        const FieldDescriptor &field ( *message.field(i) );
+        if (!field.is_required() || field.options().lazy()) {
+            return -1;
+        }
+
+        int tag = WireFormat::TagSize(field.number(), field.type());
+        switch (field.type()) {
+            case FieldDescriptor::TYPE_DOUBLE:
+            case FieldDescriptor::TYPE_FIXED64:
+            case FieldDescriptor::TYPE_SFIXED64:
+                size += tag + 8;
+                break;
+
+            case FieldDescriptor::TYPE_FLOAT:
+            case FieldDescriptor::TYPE_FIXED32:
+            case FieldDescriptor::TYPE_SFIXED32:
+                size += tag + 4;
+                break;
+
+            case FieldDescriptor::TYPE_BOOL:
+                size += tag + 1;
+                break;
+
+            case FieldDescriptor::TYPE_GROUP: {
+                // TagSize() already counts the end tag of groups
+                int group = EncodedSize(*field.message_type(), depth + 1);
+                if (group < 0) {
+                    return -1;
+                }
+                size += tag + group;
+                break;
+            }
+            case FieldDescriptor::TYPE_MESSAGE: {
+                int sub = EncodedSize(*field.message_type(), depth + 1);
+                if (sub < 0) {
+                    return -1;
+                }
+                size += tag + io::CodedOutputStream::VarintSize32(sub) + sub;
+                break;
+            }
+            default:
+                return -1;
+        }
+    }
+    return size;
+}
+
+/**
+ * Prints the loop decoding every field of a message. The loop switches on
+ * the whole tag, so the field number and wire type are matched in one
+ * comparison, and a field with an unexpected wire type takes the unknown
+ * field path.
+ *
+ * Serialisers emit fields in declaration order, so after decoding a field
+ * the next tag is compared against the tag of the next declared field, and
+ * on a match the case falls through to it without going back to the switch.
+ *
+ * When a field mask is given, fields missing from it are skipped, and the
+ * sub-mask of each message field is handed down as `submask`.
+ */
+void PHPCodeGenerator::PrintReadLoop(io::Printer &printer, const FieldDescriptor * parentField, const vector<FieldReader> & readers, const Template & next, const Template & skip, const string & unknown) const
 {
+    static const Template loop_start("\nwhile ($tag !== false) {\n");
+    static const Template end_group(
+        "case `tag`: // end group\n"
+        "`sp`break 2;\n");
+    static const Template case_start("case `tag`:\n");
+    static const Template mask_start("if ($mask !== null && !isset($mask['`field`'])) {\n");
+    static const Template mask_else("\n} else {\n");
+    static const Template case_end("\n}\n");
+    static const Template loop_end("} while ($tag === `tag`);\n");
+    static const Template fall_through(
+        "if ($tag !== `next_tag`) {\n"
+        "`sp`break;\n"
+        "}\n");
+    static const Template unknown_case(
+        "default:\n"
+        "`sp`$wire  = $tag & 0x07;\n"
+        "`sp`$field = $tag >> 3;\n"
+        "`sp``unknown`\n");
+
     map<string, string> vars;
 
-    // Parse the file options.
-    const PHPFileOptions & options (message.file()->options().GetExtension(php));
-    bool skip_unknown = options.skip_unknown();
+    vars["unknown"] = unknown;
 
-    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+    // The case of each field in its declared encoding, in declaration order,
+    // followed by the cases for the other encoding of packable fields.
+    vector<ReadCase> cases;
+    vector<ReadCase> alternates;
 
-    // Read.
-    printer.Print(
-        "\n"
-        "public function read($fp, &$limit = PHP_INT_MAX)\n{\n"
-    );
+    for (size_t i = 0; i < readers.size(); ++i) {
+        const FieldDescriptor &field (*readers[i].field);
+
+        ReadCase normal = {
+            WireFormatLite::MakeTag(field.number(), WireFormat::WireTypeForFieldType(field.type())),
+            &field, readers[i].commands, field.is_repeated()
+        };
+
+        if (field.is_repeated() && field.is_packable()) {
+            ReadCase packed = {
+                WireFormatLite::MakeTag(field.number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED),
+                &field, readers[i].packed_commands, false
+            };
+
+            if (field.is_packed()) {
+                cases.push_back(packed);
+                alternates.push_back(normal);
+            } else {
+                cases.push_back(normal);
+                alternates.push_back(packed);
+            }
+        } else {
+            cases.push_back(normal);
+        }
+    }
+
+    next.Print(printer, vars);
+    loop_start.Print(printer, vars);
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
-    printer.Print("while (!feof($fp) && $limit > 0) {\n");
+    printer.Print("switch ($tag) {\n");
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
-    vars["name"] = ClassName(message);
+    // If we are a group message, we need to add a end group case.
+    if (parentField && parentField->type() == FieldDescriptor::TYPE_GROUP) {
+        vars["tag"] = SimpleItoa(WireFormatLite::MakeTag(parentField->number(), WireFormatLite::WIRETYPE_END_GROUP));
+        end_group.Print(printer, vars);
+    }
 
-    printer.Print(
-        vars,
-        "$tag = Protobuf::readVarint($fp, $limit);\n"
-        "if ($tag === false) {\n"
-        "`sp`break;\n"
+    for (size_t i = 0; i < cases.size() + alternates.size(); ++i) {
+        bool is_alternate = i >= cases.size();
+        const ReadCase & c (is_alternate ? alternates[i - cases.size()] : cases[i]);
+
+        vars["tag"]     = SimpleItoa(c.tag);
+        vars["wire"]    = SimpleItoa(WireFormatLite::GetTagWireType(c.tag));
+        vars["name"]    = VariableName(*c.field);
+        vars["var"]     = VariableName(*c.field) + (c.field->is_repeated() ? "[]" : "");
+        vars["field"]   = c.field->name();
+        vars["submask"] = "$mask === null || $mask['" + c.field->name() + "'] === true ? null : $mask['" + c.field->name() + "']";
+        vars["format"]  = PackedFormat(*c.field);
+        if (c.field->message_type() != NULL) {
+            vars["class"] = ClassName(*c.field->message_type());
+        }
+
+        case_start.Print(printer, vars);
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Indent();
+        }
+
+        if (c.loop) {
+            // Repeated elements are serialised back to back.
+            printer.Print("do {\n");
+            for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+                printer.Indent();
+            }
+        }
+
+        mask_start.Print(printer, vars);
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Indent();
+        }
+        skip.Print(printer, vars);
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Outdent();
+        }
+        mask_else.Print(printer, vars);
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Indent();
+        }
+        c.commands->Print(printer, vars);
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Outdent();
+        }
+        case_end.Print(printer, vars);
+        next.Print(printer, vars);
+        printer.Print("\n");
+
+        if (c.loop) {
+            for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+                printer.Outdent();
+            }
+            loop_end.Print(printer, vars);
+        }
+
+        if (!is_alternate && i + 1 < cases.size()) {
+            // Fall through to the next field when it comes next.
+            vars["next_tag"] = SimpleItoa(cases[i + 1].tag);
+            fall_through.Print(printer, vars);
+        } else {
+            printer.Print("break;\n");
+        }
+
+        for (int j = 0; j < STYLE_NB_SPACES / 2; ++j) {
+            printer.Outdent();
+        }
+    }
+
+    unknown_case.Print(printer, vars);
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Indent();
+    }
+    next.Print(printer, vars);
+    printer.Print("\n");
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Outdent();
+    }
+
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Outdent();
+    }
+    printer.Print("}\n"); // switch
+
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Outdent();
+    }
+    printer.Print("}\n"); // while
+}
+
+void PHPCodeGenerator::PrintMessageRead(io::Printer &printer, const Descriptor & message, vector<const FieldDescriptor *> & required_fields, const FieldDescriptor * parentField) const
+{
+    static const Template read_double(
+        "$tmp = fread($fp, 8);\n"
+        "if ($tmp === false || strlen($tmp) !== 8) {\n"
+        "`sp`throw new Exception('Unexpected end of stream');\n"
+        "}\n"
+        "$this->`var` = unpack('e', $tmp)[1];\n"
+        "$limit -= 8;");
+    static const Template read_float(
+        "$tmp = fread($fp, 4);\n"
+        "if ($tmp === false || strlen($tmp) !== 4) {\n"
+        "`sp`throw new Exception('Unexpected end of stream');\n"
+        "}\n"
+        "$this->`var` = unpack('g', $tmp)[1];\n"
+        "$limit -= 4;");
+    static const Template read_varint(
+        "$tmp = Protobuf::readVarint($fp, $limit);\n"
+        "if ($tmp === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "$this->`var` = $tmp;");
+    static const Template read_fixed64(
+        "$tmp = fread($fp, 8);\n"
+        "if ($tmp === false || strlen($tmp) !== 8) {\n"
+        "`sp`throw new Exception('Unexpected end of stream');\n"
+        "}\n"
+        "$this->`var` = unpack('P', $tmp)[1];\n"
+        "$limit -= 8;");
+    static const Template read_fixed32(
+        "$tmp = fread($fp, 4);\n"
+        "if ($tmp === false || strlen($tmp) !== 4) {\n"
+        "`sp`throw new Exception('Unexpected end of stream');\n"
+        "}\n"
+        "$this->`var` = unpack('V', $tmp)[1];\n"
+        "$limit -= 4;");
+    static const Template read_sfixed32(
+        "$tmp = fread($fp, 4);\n"
+        "if ($tmp === false || strlen($tmp) !== 4) {\n"
+        "`sp`throw new Exception('Unexpected end of stream');\n"
+        "}\n"
+        "$this->`var` = (unpack('V', $tmp)[1] ^ 0x80000000) - 0x80000000;\n"
+        "$limit -= 4;");
+    static const Template read_bool(
+        "$tmp = Protobuf::readVarint($fp, $limit);\n"
+        "if ($tmp === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "$this->`var` = $tmp > 0 ? true : false;");
+    static const Template read_string(
+        "$len = Protobuf::readVarint($fp, $limit);\n"
+        "if ($len === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "if ($len > 0) {\n"
+        "`sp`$tmp = fread($fp, $len);\n"
+        "} else {\n"
+        "`sp`$tmp = '';\n"
+        "}\n"
+        "if ($tmp === false) {\n"
+        "`sp`throw new Exception(\"fread($len) returned false\");\n"
         "}\n"
-        "$wire  = $tag & 0x07;\n"
-        "$field = $tag >> 3;\n"
-        //"//var_dump(\"`name`: Found $field type \".Protobuf::getWiretype($wire).\" $limit bytes left\");\n"
-        "switch ($field) {\n"
+        "$this->`var` = $tmp;\n"
+        "$limit -= $len;");
+    static const Template read_group(
+        "$tmp = new `class`();\n"
+        "$tmp->read($fp, $limit, `submask`);\n"
+        "$this->`var` = $tmp;");
+    static const Template read_lazy(
+        "$len = Protobuf::readVarint($fp, $limit);\n"
+        "if ($len === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "$limit -= $len;\n"
+        "$tmp = $len > 0 ? fread($fp, $len) : '';\n"
+        "if ($tmp === false) {\n"
+        "`sp`throw new Exception(\"fread($len) returned false\");\n"
+        "}\n"
+        "$this->`var`Raw = $tmp;\n"
+        "$this->`var` = null;");
+    static const Template read_message(
+        "$len = Protobuf::readVarint($fp, $limit);\n"
+        "if ($len === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "$limit -= $len;\n"
+        "$tmp = new `class`();\n"
+        "$tmp->read($fp, $len, `submask`);\n"
+        "$this->`var` = $tmp;\n"
+        "assert('$len == 0');");
+    static const Template read_zigzag(
+        "$tmp = Protobuf::readVarint($fp, $limit);\n"
+        "if ($tmp === false) {\n"
+        "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+        "}\n"
+        "$this->`var` = (($tmp >> 1) & PHP_INT_MAX) ^ -($tmp & 1);");
+    static const Template next("$tag = $limit > 0 ? Protobuf::readVarint($fp, $limit) : false;");
+    static const Template skip("$limit -= Protobuf::skipField($fp, `wire`);");
+    static const Template read_end(
+        "if ($mask === null && !$this->validateRequired()) {\n"
+        "`sp`throw new Exception('Required fields are missing');\n"
+        "}\n");
+
+    // Parse the file options.
+    bool skip_unknown = SkipUnknown(*message.file());
+
+    // Read.
+    printer.Print(
+        "\n"
+        "public function read($fp, &$limit = PHP_INT_MAX, $mask = null)\n{\n"
     );
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
-    // If we are a group message, we need to add a end group case.
-    if (parentField && parentField->type() == FieldDescriptor::TYPE_GROUP) {
-        printer.Print("case `index`:\n", "index", SimpleItoa(parentField->number()));
-        printer.Print(vars,
-            "`sp`assert('$wire == 4');\n"
-            "`sp`break 2;\n");
-    }
+    vector<FieldReader> readers;
 
     for (int i = 0; i < message.field_count(); ++i) {
         const FieldDescriptor &field (*message.field(i));
 
-        string var ( VariableName(field) );
-        if (field.is_repeated()) {
-            var += "[]";
-        }
-        if (field.is_packed()) {
-            throw "Error: packed values not supported yet";
-        }
         if (field.is_required()) {
             required_fields.push_back( &field );
         }
 
-        string commands;
+        const Template * commands;
 
         switch (field.type()) {
             case FieldDescriptor::TYPE_DOUBLE: // double, exactly eight bytes on the wire
-                commands = "assert('$wire == 1');\n"
-                           "$tmp = Protobuf::readDouble($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readDouble returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 8;";
+                commands = &read_double;
                 break;
 
             case FieldDescriptor::TYPE_FLOAT: // float, exactly four bytes on the wire.
-                commands = "assert('$wire == 5');\n"
-                           "$tmp = Protobuf::readFloat($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readFloat returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 4;";
+                commands = &read_float;
                 break;
 
             case FieldDescriptor::TYPE_INT64:  // int64, varint on the wire.
@@ -279,172 +867,428 @@ void PHPCodeGenerator::PrintMessageRead(io::Printer &printer, const Descriptor &
             case FieldDescriptor::TYPE_INT32:  // int32, varint on the wire.
             case FieldDescriptor::TYPE_UINT32: // uint32, varint on the wire
             case FieldDescriptor::TYPE_ENUM:   // Enum, varint on the wire
-                commands = "assert('$wire == 0');\n"
-                           "$tmp = Protobuf::readVarint($fp, $limit);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;";
-                break;
-
-            case FieldDescriptor::TYPE_FIXED64: // uint64, exactly eight bytes on the wire.
-                commands = "assert('$wire == 1');\n"
-                           "$tmp = Protobuf::readUint64($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readUint64 returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 8;";
+                commands = &read_varint;
                 break;
 
+            case FieldDescriptor::TYPE_FIXED64:  // uint64, exactly eight bytes on the wire.
             case FieldDescriptor::TYPE_SFIXED64: // int64, exactly eight bytes on the wire
-                commands = "assert('$wire == 1');\n"
-                           "$tmp = Protobuf::readInt64($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readInt64 returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 8;";
+                commands = &read_fixed64;
                 break;
 
             case FieldDescriptor::TYPE_FIXED32: // uint32, exactly four bytes on the wire.
-                commands = "assert('$wire == 5');\n"
-                           "$tmp = Protobuf::readUint32($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readUint32 returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 4;";
+                commands = &read_fixed32;
                 break;
 
             case FieldDescriptor::TYPE_SFIXED32: // int32, exactly four bytes on the wire
-                commands = "assert('$wire == 5');\n"
-                           "$tmp = Protobuf::readInt32($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readInt32 returned false');\n"
-                           "}\n"
-                           "this->`var` = $tmp\n;"
-                           "$limit -= 4;";
+                commands = &read_sfixed32;
                 break;
 
             case FieldDescriptor::TYPE_BOOL: // bool, varint on the wire.
-                commands = "assert('$wire == 0');\n"
-                           "$tmp = Protobuf::readVarint($fp, $limit);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp > 0 ? true : false;";
+                commands = &read_bool;
                 break;
 
             case FieldDescriptor::TYPE_STRING: // UTF-8 text.
             case FieldDescriptor::TYPE_BYTES: // Arbitrary byte array.
-                commands = "assert('$wire == 2');\n"
-                           "$len = Protobuf::readVarint($fp, $limit);\n"
-                           "if ($len === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
-                           "}\n"
-                           "if ($len > 0) {\n"
-                           "`sp`$tmp = fread($fp, $len);\n"
-                           "} else {\n"
-                           "`sp`$tmp = '';\n"
-                           "}\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception(\"fread($len) returned false\");\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= $len;";
+                commands = &read_string;
                 break;
 
-            case FieldDescriptor::TYPE_GROUP: { // Tag-delimited message. Deprecated.
-                const Descriptor & d(*field.message_type());
-                commands = "assert('$wire == 3');\n"
-                           "$this->`var` = new " + ClassName(d) + "($fp, $limit);";
+            case FieldDescriptor::TYPE_GROUP: // Tag-delimited message. Deprecated.
+                commands = &read_group;
                 break;
-            }
 
-            case FieldDescriptor::TYPE_MESSAGE: { // Length-delimited message.
-                const Descriptor & d(*field.message_type());
-                commands = "assert('$wire == 2');\n"
-                           "$len = Protobuf::readVarint($fp, $limit);\n"
-                           "if ($len === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
-                           "}\n"
-                           "$limit -= $len;\n"
-                           "$this->`var` = new " + ClassName(d) + "($fp, $len);\n"
-                           "assert('$len == 0');";
+            case FieldDescriptor::TYPE_MESSAGE: // Length-delimited message.
+                commands = IsLazy(field) ? &read_lazy : &read_message;
                 break;
-            }
 
             case FieldDescriptor::TYPE_SINT32: // int32, ZigZag-encoded varint on the wire
-                commands = "assert('$wire == 5');\n"
-                           "$tmp = Protobuf::readZint32($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readZint32 returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 4;";
-                break;
-
             case FieldDescriptor::TYPE_SINT64: // int64, ZigZag-encoded varint on the wire
-                commands = "assert('$wire == 1');\n"
-                           "$tmp = Protobuf::readZint64($fp);\n"
-                           "if ($tmp === false) {\n"
-                           "`sp`throw new Exception('Protobuf::readZint64 returned false');\n"
-                           "}\n"
-                           "$this->`var` = $tmp;\n"
-                           "$limit -= 8;";
+                commands = &read_zigzag;
                 break;
 
             default:
                 throw "Error: Unsupported type";// TODO use the proper exception
         }
 
-        printer.Print("case `index`:\n", "index", SimpleItoa(field.number()) );
-
-        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-            printer.Indent();
-        }
-        vars["var"] = var;
-        printer.Print(vars, commands.c_str());
-        printer.Print("\n\nbreak;\n");
-        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-            printer.Outdent();
+        FieldReader reader;
+        reader.field           = &field;
+        reader.commands        = commands;
+        reader.packed_commands = NULL;
+        if (field.is_repeated() && field.is_packable()) {
+            reader.packed_commands = &PackedReadCommands(field, false);
         }
+        readers.push_back(reader);
     }
 
+    string unknown;
     if (skip_unknown) {
-        printer.Print(
-            vars,
-            "default:\n"
-            "`sp`$limit -= Protobuf::skipField($fp, $wire);\n"
-        );
+        unknown = "$limit -= Protobuf::skipField($fp, $wire);";
     } else {
-        printer.Print(
-            vars,
-            "default:\n"
-            "`sp`$this->unknown[$field.'-'.Protobuf::getWiretype($wire)][] = Protobuf::readField($fp, $wire, $limit);\n"
-        );
+        unknown = "$this->unknown[$field.'-'.Protobuf::getWiretype($wire)][] = Protobuf::readField($fp, $wire, $limit);";
     }
 
+    PrintReadLoop(printer, parentField, readers, next, skip, unknown);
+
+    read_end.Print(printer, map<string, string>());
+
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Outdent(); printer.Outdent();
+        printer.Outdent();
     }
+    printer.Print("}\n");
+}
+
+/**
+ * Prints the mergeFromString() method, which decodes the fields found in
+ * $buf between $pos and $end. It never touches a stream, and advances $pos
+ * past the last byte consumed.
+ */
+void PHPCodeGenerator::PrintMessageMergeFromString(io::Printer &printer, const Descriptor & message, const FieldDescriptor * parentField) const
+{
+    static const Template read_double(
+        "$this->`var` = unpack('e', $buf, $pos)[1];\n"
+        "$pos += 8;");
+    static const Template read_float(
+        "$this->`var` = unpack('g', $buf, $pos)[1];\n"
+        "$pos += 4;");
+    static const Template read_varint(
+        InlineVarintText("$tmp", "$buf", "$pos") + "\n"
+        "$this->`var` = $tmp;");
+    static const Template read_fixed64(
+        "$this->`var` = unpack('P', $buf, $pos)[1];\n"
+        "$pos += 8;");
+    static const Template read_fixed32(
+        "$this->`var` = unpack('V', $buf, $pos)[1];\n"
+        "$pos += 4;");
+    static const Template read_sfixed32(
+        "$this->`var` = (unpack('V', $buf, $pos)[1] ^ 0x80000000) - 0x80000000;\n"
+        "$pos += 4;");
+    static const Template read_bool(
+        InlineVarintText("$tmp", "$buf", "$pos") + "\n"
+        "$this->`var` = $tmp > 0 ? true : false;");
+    static const Template read_string(
+        InlineVarintText("$len", "$buf", "$pos") + "\n"
+        "$this->`var` = (string) substr($buf, $pos, $len);\n"
+        "$pos += $len;");
+    static const Template read_group(
+        "$tmp = new `class`();\n"
+        "$tmp->mergeFromString($buf, $pos, $end, `submask`);\n"
+        "$this->`var` = $tmp;");
+    static const Template read_lazy(
+        InlineVarintText("$len", "$buf", "$pos") + "\n"
+        "$this->`var`Raw = (string) substr($buf, $pos, $len);\n"
+        "$this->`var` = null;\n"
+        "$pos += $len;");
+    static const Template read_message(
+        InlineVarintText("$len", "$buf", "$pos") + "\n"
+        "$tmp = new `class`();\n"
+        "$tmp->mergeFromString($buf, $pos, $pos + $len, `submask`);\n"
+        "$this->`var` = $tmp;");
+    static const Template read_zigzag(
+        InlineVarintText("$tmp", "$buf", "$pos") + "\n"
+        "$this->`var` = (($tmp >> 1) & PHP_INT_MAX) ^ -($tmp & 1);");
+    static const Template next(
+        "if ($pos >= $end) {\n"
+        "`sp`$tag = false;\n"
+        "} else" + InlineVarintText("$tag", "$buf", "$pos"));
+    static const Template skip("Protobuf::skipFieldFromString($buf, $pos, `wire`);");
+    static const Template read_end(
+        "if ($pos > $end) {\n"
+        "`sp`throw new Exception('Unexpected end of buffer');\n"
+        "}\n"
+        "if ($mask === null && !$this->validateRequired()) {\n"
+        "`sp`throw new Exception('Required fields are missing');\n"
+        "}\n");
+
+    // Parse the file options.
+    bool skip_unknown = SkipUnknown(*message.file());
+
     printer.Print(
-        vars,
-        "`sp`}\n" // switch
-        "}\n"     // while
+        "\n"
+        "public function mergeFromString($buf, &$pos, $end, $mask = null)\n{\n"
     );
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Indent();
+    }
+
+    vector<FieldReader> readers;
+
+    for (int i = 0; i < message.field_count(); ++i) {
+        const FieldDescriptor &field (*message.field(i));
+
+        const Template * commands;
+
+        switch (field.type()) {
+            case FieldDescriptor::TYPE_DOUBLE: // double, exactly eight bytes on the wire
+                commands = &read_double;
+                break;
+
+            case FieldDescriptor::TYPE_FLOAT: // float, exactly four bytes on the wire.
+                commands = &read_float;
+                break;
+
+            case FieldDescriptor::TYPE_INT64:  // int64, varint on the wire.
+            case FieldDescriptor::TYPE_UINT64: // uint64, varint on the wire.
+            case FieldDescriptor::TYPE_INT32:  // int32, varint on the wire.
+            case FieldDescriptor::TYPE_UINT32: // uint32, varint on the wire
+            case FieldDescriptor::TYPE_ENUM:   // Enum, varint on the wire
+                commands = &read_varint;
+                break;
+
+            case FieldDescriptor::TYPE_FIXED64:  // uint64, exactly eight bytes on the wire.
+            case FieldDescriptor::TYPE_SFIXED64: // int64, exactly eight bytes on the wire
+                commands = &read_fixed64;
+                break;
+
+            case FieldDescriptor::TYPE_FIXED32: // uint32, exactly four bytes on the wire.
+                commands = &read_fixed32;
+                break;
+
+            case FieldDescriptor::TYPE_SFIXED32: // int32, exactly four bytes on the wire
+                commands = &read_sfixed32;
+                break;
+
+            case FieldDescriptor::TYPE_BOOL: // bool, varint on the wire.
+                commands = &read_bool;
+                break;
+
+            case FieldDescriptor::TYPE_STRING: // UTF-8 text.
+            case FieldDescriptor::TYPE_BYTES: // Arbitrary byte array.
+                commands = &read_string;
+                break;
+
+            case FieldDescriptor::TYPE_GROUP: // Tag-delimited message. Deprecated.
+                commands = &read_group;
+                break;
+
+            case FieldDescriptor::TYPE_MESSAGE: // Length-delimited message.
+                commands = IsLazy(field) ? &read_lazy : &read_message;
+                break;
+
+            case FieldDescriptor::TYPE_SINT32: // int32, ZigZag-encoded varint on the wire
+            case FieldDescriptor::TYPE_SINT64: // int64, ZigZag-encoded varint on the wire
+                commands = &read_zigzag;
+                break;
+
+            default:
+                throw "Error: Unsupported type";// TODO use the proper exception
+        }
+
+        FieldReader reader;
+        reader.field           = &field;
+        reader.commands        = commands;
+        reader.packed_commands = NULL;
+        if (field.is_repeated() && field.is_packable()) {
+            reader.packed_commands = &PackedReadCommands(field, true);
+        }
+        readers.push_back(reader);
+    }
+
+    string unknown;
+    if (skip_unknown) {
+        unknown = "Protobuf::skipFieldFromString($buf, $pos, $wire);";
+    } else {
+        unknown = "$this->unknown[$field.'-'.Protobuf::getWiretype($wire)][] = Protobuf::readFieldFromString($buf, $pos, $wire);";
+    }
+
+    PrintReadLoop(printer, parentField, readers, next, skip, unknown);
+
+    read_end.Print(printer, map<string, string>());
 
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Outdent();
     }
-    printer.Print(
-        vars,
-        "`sp`if (!$this->validateRequired()) {\n"
-        "`sp``sp`throw new Exception('Required fields are missing');\n"
-        "`sp`}\n"
-        "}\n"
-    );
+    printer.Print("}\n");
+}
+
+// The ways a packed repeated field is decoded.
+enum PackedKind { PACKED_FIXED, PACKED_SFIXED32, PACKED_BOOL, PACKED_ZIGZAG, PACKED_VARINT };
+
+/**
+ * Returns the text of the commands to decode the payload of a packed
+ * repeated field, either from the stream ($fp) or from the string buffer
+ * ($buf). Fixed width values are decoded with a single unpack() call, in
+ * the `format` of PackedFormat().
+ */
+string PackedReadText(PackedKind kind, bool from_string)
+{
+    string commands;
+    string buf, pos, slice, stop, advance;
+
+    if (from_string) {
+        commands = InlineVarintText("$len", "$buf", "$pos") + "\n";
+        buf     = "$buf";
+        pos     = "$pos";
+        slice   = "substr($buf, $pos, $len)";
+        stop    = "$stop = $pos + $len;\n";
+        advance = "\n$pos += $len;";
+    } else {
+        commands = "$len = Protobuf::readVarint($fp, $limit);\n"
+                   "if ($len === false) {\n"
+                   "`sp`throw new Exception('Protobuf::readVarint returned false');\n"
+                   "}\n"
+                   "$limit -= $len;\n"
+                   "$data = $len > 0 ? fread($fp, $len) : '';\n"
+                   "if ($data === false) {\n"
+                   "`sp`throw new Exception(\"fread($len) returned false\");\n"
+                   "}\n";
+        buf     = "$data";
+        pos     = "$p";
+        slice   = "$data";
+        stop    = "$p = 0;\n"
+                  "$stop = $len;\n";
+    }
+
+    string value = IndentText(InlineVarintText("$v", buf, pos)) + "\n";
+
+    switch (kind) {
+        case PACKED_FIXED:
+            return commands +
+                   "if ($len > 0) {\n"
+                   "`sp`$this->`name` = array_merge((array) $this->`name`, unpack('`format`', " + slice + "));\n"
+                   "}" + advance;
+
+        case PACKED_SFIXED32:
+            return commands +
+                   "if ($len > 0) {\n"
+                   "`sp`foreach (unpack('V*', " + slice + ") as $v) {\n"
+                   "`sp``sp`$this->`name`[] = ($v ^ 0x80000000) - 0x80000000;\n"
+                   "`sp`}\n"
+                   "}" + advance;
+
+        case PACKED_ZIGZAG:
+            return commands + stop +
+                   "while (" + pos + " < $stop) {\n" + value +
+                   "`sp`$this->`name`[] = (($v >> 1) & PHP_INT_MAX) ^ -($v & 1);\n"
+                   "}";
+
+        case PACKED_BOOL:
+            return commands + stop +
+                   "while (" + pos + " < $stop) {\n" + value +
+                   "`sp`$this->`name`[] = $v > 0;\n"
+                   "}";
+
+        default:
+            break;
+    }
+
+    // Varints
+    return commands + stop +
+           "while (" + pos + " < $stop) {\n" + value +
+           "`sp`$this->`name`[] = $v;\n"
+           "}";
+}
+
+/**
+ * Returns the commands to decode the payload of a packed repeated field.
+ */
+const Template & PHPCodeGenerator::PackedReadCommands(const FieldDescriptor & field, bool from_string) const
+{
+    static const Template from_stream_templates[] = {
+        Template(PackedReadText(PACKED_FIXED, false)),
+        Template(PackedReadText(PACKED_SFIXED32, false)),
+        Template(PackedReadText(PACKED_BOOL, false)),
+        Template(PackedReadText(PACKED_ZIGZAG, false)),
+        Template(PackedReadText(PACKED_VARINT, false)),
+    };
+    static const Template from_string_templates[] = {
+        Template(PackedReadText(PACKED_FIXED, true)),
+        Template(PackedReadText(PACKED_SFIXED32, true)),
+        Template(PackedReadText(PACKED_BOOL, true)),
+        Template(PackedReadText(PACKED_ZIGZAG, true)),
+        Template(PackedReadText(PACKED_VARINT, true)),
+    };
+
+    PackedKind kind;
+    switch (field.type()) {
+        case FieldDescriptor::TYPE_SFIXED32: kind = PACKED_SFIXED32; break;
+        case FieldDescriptor::TYPE_BOOL:     kind = PACKED_BOOL;     break;
+        case FieldDescriptor::TYPE_SINT32:
+        case FieldDescriptor::TYPE_SINT64:   kind = PACKED_ZIGZAG;   break;
+        default:
+            kind = PackedFormat(field).empty() ? PACKED_VARINT : PACKED_FIXED;
+            break;
+    }
+
+    return from_string ? from_string_templates[kind] : from_stream_templates[kind];
+}
+
+/**
+ * Returns the commands encoding the payload of a packed repeated field
+ * into $data. Fixed width values are encoded with a single pack() call.
+ */
+const Template & PHPCodeGenerator::PackedWriteCommands(const FieldDescriptor & field) const
+{
+    static const Template write_fixed("$data = pack('`format`', ...$this->`name`);\n");
+    static const Template write_bool(
+        "$data = '';\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$data .= $v ? \"\\x01\" : \"\\x00\";\n"
+        "}\n");
+    static const Template write_sint32(
+        "$data = '';\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$data .= Protobuf::encodeVarint(($v << 1) ^ ($v >> 31));\n"
+        "}\n");
+    static const Template write_sint64(
+        "$data = '';\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$data .= Protobuf::encodeVarint(($v << 1) ^ ($v >> 63));\n"
+        "}\n");
+    static const Template write_varint(
+        "$data = '';\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$data .= Protobuf::encodeVarint($v);\n"
+        "}\n");
+
+    switch (field.type()) {
+        case FieldDescriptor::TYPE_BOOL:   return write_bool;
+        case FieldDescriptor::TYPE_SINT32: return write_sint32;
+        case FieldDescriptor::TYPE_SINT64: return write_sint64;
+        default:
+            return PackedFormat(field).empty() ? write_varint : write_fixed;
+    }
+}
+
+/**
+ * Returns the commands that set $l to the payload size of a packed repeated field.
+ */
+const Template & PHPCodeGenerator::PackedSizeCommands(const FieldDescriptor & field) const
+{
+    static const Template size_fixed32("$l = count($this->`name`) * 4;\n");
+    static const Template size_fixed64("$l = count($this->`name`) * 8;\n");
+    static const Template size_bool("$l = count($this->`name`);\n");
+    static const Template size_sint32(
+        "$l = 0;\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$l += Protobuf::sizeVarint(($v << 1) ^ ($v >> 31));\n"
+        "}\n");
+    static const Template size_sint64(
+        "$l = 0;\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$l += Protobuf::sizeVarint(($v << 1) ^ ($v >> 63));\n"
+        "}\n");
+    static const Template size_varint(
+        "$l = 0;\n"
+        "foreach ($this->`name` as $v) {\n"
+        "`sp`$l += Protobuf::sizeVarint($v);\n"
+        "}\n");
+
+    switch (WireFormat::WireTypeForFieldType(field.type())) {
+        case WireFormatLite::WIRETYPE_FIXED32:
+            return size_fixed32;
+
+        case WireFormatLite::WIRETYPE_FIXED64:
+            return size_fixed64;
+
+        default:
+            break;
+    }
+
+    switch (field.type()) {
+        case FieldDescriptor::TYPE_BOOL:   return size_bool;
+        case FieldDescriptor::TYPE_SINT32: return size_sint32;
+        case FieldDescriptor::TYPE_SINT64: return size_sint64;
+        default:                           return size_varint;
+    }
 }
 
 /**
@@ -466,7 +1310,7 @@ string arrayToPHPString(uint8 *a, size_t len)
         uint8 c = *a++;
         if ((c >= 0 && c <= 31) || c >= 127) {
             p += sprintf(p, "\\x%02x", c);
-        } else if (c == '"') {
+        } else if (c == '"' || c == '\\' || c == '$') {
             *p++ = '\\';
             *p++ = c;
         } else {
@@ -503,51 +1347,106 @@ string arrayToPHPString(uint8 *a, size_t len)
  */
 void PHPCodeGenerator::PrintMessageWrite(io::Printer &printer, const Descriptor & message, const FieldDescriptor * parentField) const
 {
-    map<string, string> vars;
+    static const Template write_start(
+        "\n"
+        "public function writeWithCachedSizes($fp)\n"
+        "{\n");
+    static const Template validate(
+        "if (!$this->validateRequired()) {\n"
+        "`sp`throw new Exception('Required fields are missing');\n"
+        "}\n");
+    static const Template packed_start("if (!empty($this->`name`)) {\n");
+    static const Template write_tag("fwrite($fp, \"`tag`\");\n");
+    static const Template packed_end(
+        "Protobuf::writeVarint($fp, strlen($data));\n"
+        "fwrite($fp, $data);\n");
+    static const Template write_double("fwrite($fp, pack('e', `var`));\n");
+    static const Template write_float("fwrite($fp, pack('g', `var`));\n");
+    static const Template write_varint("Protobuf::writeVarint($fp, `var`);\n");
+    static const Template write_fixed64("fwrite($fp, pack('P', `var`));\n");
+    static const Template write_fixed32("fwrite($fp, pack('V', `var`));\n");
+    static const Template write_bool("Protobuf::writeVarint($fp, `var` ? 1 : 0);\n");
+    static const Template write_string(
+        "Protobuf::writeVarint($fp, strlen(`var`));\n"
+        "fwrite($fp, `var`);\n");
+    static const Template write_group(
+        "`var`->writeWithCachedSizes($fp); // group\n"
+        "fwrite($fp, \"`endtag`\");\n");
+    static const Template write_message(
+        "Protobuf::writeVarint($fp, `var`->getCachedSize()); // message\n"
+        "`var`->writeWithCachedSizes($fp);\n");
+    static const Template write_fixed_message(
+        "fwrite($fp, \"`length`\"); // message\n"
+        "`var`->writeWithCachedSizes($fp);\n");
+    static const Template write_sint32("Protobuf::writeVarint($fp, (`var` << 1) ^ (`var` >> 31));\n");
+    static const Template write_sint64("Protobuf::writeVarint($fp, (`var` << 1) ^ (`var` >> 63));\n");
+    static const Template repeated_start(
+        "if (!is_null($this->`var`)) {\n"
+        "`sp`foreach ($this->`var` as $v) {\n");
+    static const Template repeated_end("`sp`}\n}\n");
+    static const Template write_raw(
+        "if ($this->`name`Raw !== null) {\n"
+        "`sp`fwrite($fp, \"`tag`\");\n"
+        "`sp`Protobuf::writeVarint($fp, strlen($this->`name`Raw));\n"
+        "`sp`fwrite($fp, $this->`name`Raw);\n"
+        "} else");
+    static const Template single_start("if (!is_null($this->`var`)) {\n");
 
-    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+    map<string, string> vars;
 
-    // Write.
-    printer.Print(
-        "\n"
-        "public function write($fp)\n"
-        "{\n"
-    );
+    // Write. ProtobufMessage::write() sizes the message first, which caches
+    // the size of every nested message for writeWithCachedSizes().
+    write_start.Print(printer, vars);
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
-    printer.Print(
-        vars,
-        "if (!$this->validateRequired()) {\n"
-        "`sp`throw new Exception('Required fields are missing');\n"
-        "}\n"
-    );
+    validate.Print(printer, vars);
 
     for (int i = 0; i < message.field_count(); ++i) {
         const FieldDescriptor &field ( *message.field(i) );
 
-        if (field.is_packed()) {
-            throw "Error: packed values not supported yet";
-        }
-
         // Create the tag.
         uint8 tag[5];
         uint8 *tmp;
+
+        if (field.is_packed()) {
+            tmp = WireFormatLite::WriteTagToArray(
+                    field.number(),
+                    WireFormatLite::WIRETYPE_LENGTH_DELIMITED,
+                    tag);
+
+            vars["name"]   = VariableName(field);
+            vars["tag"]    = arrayToPHPString(tag, tmp - tag);
+            vars["format"] = PackedFormat(field);
+            packed_start.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent();
+            }
+            write_tag.Print(printer, vars);
+            PackedWriteCommands(field).Print(printer, vars);
+            packed_end.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent();
+            }
+            printer.Print("}\n");
+            continue;
+        }
+
         tmp = WireFormatLite::WriteTagToArray(
                 field.number(),
                 WireFormat::WireTypeForFieldType(field.type()),
                 tag);
-        int tagLen = tmp - tag;
+        vars["tag"] = arrayToPHPString(tag, tmp - tag);
 
-        string commands;
+        const Template * commands;
         switch (field.type()) {
             case FieldDescriptor::TYPE_DOUBLE: // double, exactly eight bytes on the wire
-                commands = "Protobuf::writeDouble($fp, `var`);\n";
+                commands = &write_double;
                 break;
 
             case FieldDescriptor::TYPE_FLOAT: // float, exactly four bytes on the wire.
-                commands = "Protobuf::writeFloat($fp, `var`);\n";
+                commands = &write_float;
                 break;
 
             case FieldDescriptor::TYPE_INT64:  // int64, varint on the wire.
@@ -555,33 +1454,26 @@ void PHPCodeGenerator::PrintMessageWrite(io::Printer &printer, const Descriptor
             case FieldDescriptor::TYPE_INT32:  // int32, varint on the wire.
             case FieldDescriptor::TYPE_UINT32: // uint32, varint on the wire
             case FieldDescriptor::TYPE_ENUM:   // Enum, varint on the wire
-                commands = "Protobuf::writeVarint($fp, `var`);\n";
-                break;
-
-            case FieldDescriptor::TYPE_FIXED64: // uint64, exactly eight bytes on the wire.
-                commands = "Protobuf::writeUint64($fp, `var`);\n";
+                commands = &write_varint;
                 break;
 
+            case FieldDescriptor::TYPE_FIXED64:  // uint64, exactly eight bytes on the wire.
             case FieldDescriptor::TYPE_SFIXED64: // int64, exactly eight bytes on the wire
-                commands = "Protobuf::writeInt64($fp, `var`);\n";
-                break;
-
-            case FieldDescriptor::TYPE_FIXED32: // uint32, exactly four bytes on the wire.
-                commands = "Protobuf::writeUint32($fp, `var`);\n";
+                commands = &write_fixed64;
                 break;
 
+            case FieldDescriptor::TYPE_FIXED32:  // uint32, exactly four bytes on the wire.
             case FieldDescriptor::TYPE_SFIXED32: // int32, exactly four bytes on the wire
-                commands = "Protobuf::writeInt32($fp, `var`);\n";
+                commands = &write_fixed32;
                 break;
 
             case FieldDescriptor::TYPE_BOOL: // bool, varint on the wire.
-                commands = "Protobuf::writeVarint($fp, `var` ? 1 : 0);\n";
+                commands = &write_bool;
                 break;
 
             case FieldDescriptor::TYPE_STRING:  // UTF-8 text.
             case FieldDescriptor::TYPE_BYTES:   // Arbitrary byte array.
-                commands = "Protobuf::writeVarint($fp, strlen(`var`));\n"
-                           "fwrite($fp, `var`);\n";
+                commands = &write_string;
                 break;
 
             case FieldDescriptor::TYPE_GROUP: {// Tag-delimited message.  Deprecated.
@@ -591,22 +1483,30 @@ void PHPCodeGenerator::PrintMessageWrite(io::Printer &printer, const Descriptor
                         field.number(),
                         WireFormatLite::WIRETYPE_END_GROUP,
                         endtag);
-                int endtagLen = tmp - endtag;
-                commands = "`var`->write($fp); // group\n"
-                           "fwrite($fp, \"" + arrayToPHPString(endtag, endtagLen) + "\");\n";
+                vars["endtag"] = arrayToPHPString(endtag, tmp - endtag);
+                commands = &write_group;
                 break;
             }
-            case FieldDescriptor::TYPE_MESSAGE: // Length-delimited message.
-                commands = "Protobuf::writeVarint($fp, `var`->size()); // message\n"
-                           "`var`->write($fp);\n";
+            case FieldDescriptor::TYPE_MESSAGE: { // Length-delimited message.
+                // The length of fixed size messages is known, and printed as is
+                int size = EncodedSize(*field.message_type());
+                if (size >= 0) {
+                    uint8 length[5];
+                    tmp = io::CodedOutputStream::WriteVarint32ToArray(size, length);
+                    vars["length"] = arrayToPHPString(length, tmp - length);
+                    commands = &write_fixed_message;
+                } else {
+                    commands = &write_message;
+                }
                 break;
+            }
 
             case FieldDescriptor::TYPE_SINT32: // int32, ZigZag-encoded varint on the wire
-                commands = "Protobuf::writeZint32($fp, `var`);\n";
+                commands = &write_sint32;
                 break;
 
             case FieldDescriptor::TYPE_SINT64: // int64, ZigZag-encoded varint on the wire
-                commands = "Protobuf::writeZint64($fp, `var`);\n";
+                commands = &write_sint64;
                 break;
 
             default:
@@ -615,32 +1515,31 @@ void PHPCodeGenerator::PrintMessageWrite(io::Printer &printer, const Descriptor
 
         if (field.is_repeated()) {
             vars["var"] = VariableName(field);
-            printer.Print(
-                vars,
-                "if (!is_null($this->`var`)) {\n"
-                "`sp`foreach ($this->`var` as $v) {\n"
-            );
+            repeated_start.Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Indent(); printer.Indent();
             }
-            printer.Print("fwrite($fp, \"`tag`\");\n", "tag", arrayToPHPString(tag, tagLen));
+            write_tag.Print(printer, vars);
             vars["var"] = "$v";
-            printer.Print(vars, commands.c_str());
+            commands->Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Outdent(); printer.Outdent();
             }
-            printer.Print(vars, "`sp`}\n}\n");
+            repeated_end.Print(printer, vars);
         } else {
-            printer.Print(
-                "if (!is_null($this->`var`)) {\n",
-                "var", VariableName(field)
-            );
+            if (IsLazy(field)) {
+                // A sub-message that was never decoded is written back unchanged.
+                vars["name"] = VariableName(field);
+                write_raw.Print(printer, vars);
+            }
+            vars["var"] = VariableName(field);
+            single_start.Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Indent();
             }
-            printer.Print("fwrite($fp, \"`tag`\");\n", "tag", arrayToPHPString(tag, tagLen));
+            write_tag.Print(printer, vars);
             vars["var"] = "$this->" + VariableName(field);
-            printer.Print(vars, commands.c_str());
+            commands->Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Outdent();
             }
@@ -654,103 +1553,373 @@ void PHPCodeGenerator::PrintMessageWrite(io::Printer &printer, const Descriptor
     printer.Print("}\n");
 }
 
-void PHPCodeGenerator::PrintMessageSize(io::Printer &printer, const Descriptor & message) const
+/**
+ * Prints the serializeWithCachedSizes() method, behind serializeToString() and
+ * serializeTo(), which builds the encoded message in a string instead of
+ * writing it to a stream. Tags are emitted as precomputed string literals.
+ */
+void PHPCodeGenerator::PrintMessageSerialize(io::Printer &printer, const Descriptor & message) const
 {
-    map<string, string> vars;
+    static const Template serialize_start(
+        "\n"
+        "public function serializeWithCachedSizes(&$out)\n"
+        "{\n");
+    static const Template validate(
+        "if (!$this->validateRequired()) {\n"
+        "`sp`throw new Exception('Required fields are missing');\n"
+        "}\n");
+    static const Template packed_start("if (!empty($this->`name`)) {\n");
+    static const Template packed_end("$out .= \"`tag`\".Protobuf::encodeVarint(strlen($data)).$data;\n");
+    static const Template write_double("$out .= \"`tag`\".pack('e', `var`);\n");
+    static const Template write_float("$out .= \"`tag`\".pack('g', `var`);\n");
+    static const Template write_varint("$out .= \"`tag`\".Protobuf::encodeVarint(`var`);\n");
+    static const Template write_fixed64("$out .= \"`tag`\".pack('P', `var`);\n");
+    static const Template write_fixed32("$out .= \"`tag`\".pack('V', `var`);\n");
+    static const Template write_bool("$out .= `var` ? \"`tag`\\x01\" : \"`tag`\\x00\";\n");
+    static const Template write_string("$out .= \"`tag`\".Protobuf::encodeVarint(strlen(`var`)).`var`;\n");
+    static const Template write_group(
+        "$out .= \"`tag`\";\n"
+        "`var`->serializeWithCachedSizes($out); // group\n"
+        "$out .= \"`endtag`\";\n");
+    static const Template write_message(
+        "$out .= \"`tag`\".Protobuf::encodeVarint(`var`->getCachedSize()); // message\n"
+        "`var`->serializeWithCachedSizes($out);\n");
+    static const Template write_fixed_message(
+        "$out .= \"`tag``length`\"; // message\n"
+        "`var`->serializeWithCachedSizes($out);\n");
+    static const Template write_sint32("$out .= \"`tag`\".Protobuf::encodeVarint((`var` << 1) ^ (`var` >> 31));\n");
+    static const Template write_sint64("$out .= \"`tag`\".Protobuf::encodeVarint((`var` << 1) ^ (`var` >> 63));\n");
+    static const Template repeated_start(
+        "if (!is_null($this->`var`)) {\n"
+        "`sp`foreach ($this->`var` as $v) {\n");
+    static const Template repeated_end("`sp`}\n}\n");
+    static const Template write_raw(
+        "if ($this->`name`Raw !== null) {\n"
+        "`sp`$out .= \"`tag`\".Protobuf::encodeVarint(strlen($this->`name`Raw)).$this->`name`Raw;\n"
+        "} else");
+    static const Template single_start("if (!is_null($this->`var`)) {\n");
 
-    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+    map<string, string> vars;
 
-    // Print the calc size method.
-    printer.Print(
-        vars,
-        "\n"
-        "public function size()\n"
-        "{\n"
-        "`sp`$size = 0;\n"
-    );
+    serialize_start.Print(printer, vars);
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
+    validate.Print(printer, vars);
+
     for (int i = 0; i < message.field_count(); ++i) {
         const FieldDescriptor &field ( *message.field(i) );
 
-        // Calc the size of the tag needed
-        int tag = WireFormat::TagSize(field.number(), field.type());
+        // Create the tag.
+        uint8 tag[5];
+        uint8 *tmp;
+
+        if (field.is_packed()) {
+            tmp = WireFormatLite::WriteTagToArray(
+                    field.number(),
+                    WireFormatLite::WIRETYPE_LENGTH_DELIMITED,
+                    tag);
+
+            vars["name"]   = VariableName(field);
+            vars["tag"]    = arrayToPHPString(tag, tmp - tag);
+            vars["format"] = PackedFormat(field);
+            packed_start.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent();
+            }
+            PackedWriteCommands(field).Print(printer, vars);
+            packed_end.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent();
+            }
+            printer.Print("}\n");
+            continue;
+        }
 
-        string command;
+        tmp = WireFormatLite::WriteTagToArray(
+                field.number(),
+                WireFormat::WireTypeForFieldType(field.type()),
+                tag);
+        vars["tag"] = arrayToPHPString(tag, tmp - tag);
 
-        switch (WireFormat::WireTypeForField(&field)) {
-            case WireFormatLite::WIRETYPE_VARINT:
-                if (field.type() == FieldDescriptor::TYPE_BOOL) {
-                    tag++; // A bool will always take 1 byte
-                    command = "$size += `tag`;\n";
-                } else {
-                    command = "$size += `tag` + Protobuf::sizeVarint(`var`);\n";
-                }
+        const Template * commands;
+        switch (field.type()) {
+            case FieldDescriptor::TYPE_DOUBLE: // double, exactly eight bytes on the wire
+                commands = &write_double;
                 break;
 
-            case WireFormatLite::WIRETYPE_FIXED32:
-                tag += 4;
-                command = "$size += `tag`;\n";
+            case FieldDescriptor::TYPE_FLOAT: // float, exactly four bytes on the wire.
+                commands = &write_float;
                 break;
 
-            case WireFormatLite::WIRETYPE_FIXED64:
-                tag += 8;
-                command = "$size += `tag`;\n";
+            case FieldDescriptor::TYPE_INT64:  // int64, varint on the wire.
+            case FieldDescriptor::TYPE_UINT64: // uint64, varint on the wire.
+            case FieldDescriptor::TYPE_INT32:  // int32, varint on the wire.
+            case FieldDescriptor::TYPE_UINT32: // uint32, varint on the wire
+            case FieldDescriptor::TYPE_ENUM:   // Enum, varint on the wire
+                commands = &write_varint;
                 break;
 
-            case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
-                if (field.type() == FieldDescriptor::TYPE_MESSAGE) {
-                    command = "$l = `var`->size();\n";
+            case FieldDescriptor::TYPE_FIXED64:  // uint64, exactly eight bytes on the wire.
+            case FieldDescriptor::TYPE_SFIXED64: // int64, exactly eight bytes on the wire
+                commands = &write_fixed64;
+                break;
+
+            case FieldDescriptor::TYPE_FIXED32:  // uint32, exactly four bytes on the wire.
+            case FieldDescriptor::TYPE_SFIXED32: // int32, exactly four bytes on the wire
+                commands = &write_fixed32;
+                break;
+
+            case FieldDescriptor::TYPE_BOOL: // bool, varint on the wire.
+                commands = &write_bool;
+                break;
+
+            case FieldDescriptor::TYPE_STRING:  // UTF-8 text.
+            case FieldDescriptor::TYPE_BYTES:   // Arbitrary byte array.
+                commands = &write_string;
+                break;
+
+            case FieldDescriptor::TYPE_GROUP: {// Tag-delimited message.  Deprecated.
+                uint8 endtag[5];
+                tmp = WireFormatLite::WriteTagToArray(
+                        field.number(),
+                        WireFormatLite::WIRETYPE_END_GROUP,
+                        endtag);
+                vars["endtag"] = arrayToPHPString(endtag, tmp - endtag);
+                commands = &write_group;
+                break;
+            }
+            case FieldDescriptor::TYPE_MESSAGE: { // Length-delimited message.
+                // The length of fixed size messages is known, and printed as is
+                int size = EncodedSize(*field.message_type());
+                if (size >= 0) {
+                    uint8 length[5];
+                    tmp = io::CodedOutputStream::WriteVarint32ToArray(size, length);
+                    vars["length"] = arrayToPHPString(length, tmp - length);
+                    commands = &write_fixed_message;
                 } else {
-                    command = "$l = strlen(`var`);\n";
+                    commands = &write_message;
                 }
+                break;
+            }
 
-                command += "$size += `tag` + Protobuf::sizeVarint($l) + $l;\n";
+            case FieldDescriptor::TYPE_SINT32: // int32, ZigZag-encoded varint on the wire
+                commands = &write_sint32;
                 break;
 
-            case WireFormatLite::WIRETYPE_START_GROUP:
-            case WireFormatLite::WIRETYPE_END_GROUP:
-                // WireFormat::TagSize returns the tag size * two when using groups, to account for both the start and end tag
-                command += "$size += `tag` + `var`->size();\n";
+            case FieldDescriptor::TYPE_SINT64: // int64, ZigZag-encoded varint on the wire
+                commands = &write_sint64;
                 break;
 
             default:
-                throw "Error: Unsupported wire type";// TODO use the proper exception
+                throw "Error: Unsupported type"; // TODO use the proper exception
         }
 
-        vars["tag"] = SimpleItoa(tag);
-
         if (field.is_repeated()) {
             vars["var"] = VariableName(field);
-            printer.Print(
-                vars,
-                "if (!is_null($this->`var`)) {\n"
-                "`sp`foreach ($this->`var` as $v) {\n"
-            );
+            repeated_start.Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Indent(); printer.Indent();
             }
-
             vars["var"] = "$v";
-            printer.Print(vars, command.c_str());
-
+            commands->Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Outdent(); printer.Outdent();
             }
-            printer.Print(vars, "`sp`}\n}\n");
+            repeated_end.Print(printer, vars);
         } else {
-            printer.Print(
-                "if (!is_null($this->`var`)) {\n",
-                "var", VariableName(field)
-            );
+            if (IsLazy(field)) {
+                // A sub-message that was never decoded is written back unchanged.
+                vars["name"] = VariableName(field);
+                write_raw.Print(printer, vars);
+            }
+            vars["var"] = VariableName(field);
+            single_start.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent();
+            }
+            vars["var"] = "$this->" + VariableName(field);
+            commands->Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent();
+            }
+            printer.Print("}\n");
+        }
+    }
+
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Outdent();
+    }
+    printer.Print("}\n");
+}
+
+void PHPCodeGenerator::PrintMessageSize(io::Printer &printer, const Descriptor & message) const
+{
+    static const Template size_start(
+        "\n"
+        "public function size()\n"
+        "{\n"
+        "`sp`$size = 0;\n");
+    static const Template packed_start("if (!empty($this->`name`)) {\n");
+    static const Template packed_end("$size += `tag` + Protobuf::sizeVarint($l) + $l;\n");
+    static const Template size_constant("$size += `tag`;\n");
+    static const Template size_varint("$size += `tag` + Protobuf::sizeVarint(`var`);\n");
+    static const Template size_sint32("$size += `tag` + Protobuf::sizeVarint((`var` << 1) ^ (`var` >> 31));\n");
+    static const Template size_sint64("$size += `tag` + Protobuf::sizeVarint((`var` << 1) ^ (`var` >> 63));\n");
+    static const Template size_message(
+        "$l = `var`->size();\n"
+        "$size += `tag` + Protobuf::sizeVarint($l) + $l;\n");
+    static const Template size_string(
+        "$l = strlen(`var`);\n"
+        "$size += `tag` + Protobuf::sizeVarint($l) + $l;\n");
+    static const Template size_group("$size += `tag` + `var`->size();\n");
+    static const Template repeated_start(
+        "if (!is_null($this->`var`)) {\n"
+        "`sp`foreach ($this->`var` as $v) {\n");
+    static const Template repeated_end("`sp`}\n}\n");
+    static const Template size_raw(
+        "if ($this->`name`Raw !== null) {\n"
+        "`sp`$l = strlen($this->`name`Raw);\n"
+        "`sp`$size += `tag` + Protobuf::sizeVarint($l) + $l;\n"
+        "} else");
+    static const Template single_start("if (!is_null($this->`var`)) {\n");
+    static const Template size_end(
+        "\n"
+        "`sp`$this->cachedSize = $size;\n"
+        "`sp`return $size;\n"
+        "}\n");
+    static const Template size_fixed(
+        "\n"
+        "const ENCODED_SIZE = `size`;\n"
+        "\n"
+        "public function size()\n"
+        "{\n"
+        "`sp`return $this->cachedSize = self::ENCODED_SIZE;\n"
+        "}\n");
+
+    map<string, string> vars;
+
+    // The schema alone decides the size of some messages
+    int encoded_size = EncodedSize(message);
+    if (encoded_size >= 0) {
+        vars["size"] = SimpleItoa(encoded_size);
+        size_fixed.Print(printer, vars);
+        return;
+    }
+
+    // Print the calc size method.
+    size_start.Print(printer, vars);
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Indent();
+    }
+
+    for (int i = 0; i < message.field_count(); ++i) {
+        const FieldDescriptor &field ( *message.field(i) );
+
+        // Calc the size of the tag needed
+        int tag = WireFormat::TagSize(field.number(), field.type());
+
+        if (field.is_packed()) {
+            vars["name"] = VariableName(field);
+            vars["tag"] = SimpleItoa(tag);
+            packed_start.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent();
+            }
+            PackedSizeCommands(field).Print(printer, vars);
+            packed_end.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent();
+            }
+            printer.Print("}\n");
+            continue;
+        }
+
+        const Template * command;
+
+        switch (WireFormat::WireTypeForField(&field)) {
+            case WireFormatLite::WIRETYPE_VARINT:
+                if (field.type() == FieldDescriptor::TYPE_BOOL) {
+                    tag++; // A bool will always take 1 byte
+                    command = &size_constant;
+                } else if (field.type() == FieldDescriptor::TYPE_SINT32) {
+                    command = &size_sint32;
+                } else if (field.type() == FieldDescriptor::TYPE_SINT64) {
+                    command = &size_sint64;
+                } else {
+                    command = &size_varint;
+                }
+                break;
+
+            case WireFormatLite::WIRETYPE_FIXED32:
+                tag += 4;
+                command = &size_constant;
+                break;
+
+            case WireFormatLite::WIRETYPE_FIXED64:
+                tag += 8;
+                command = &size_constant;
+                break;
+
+            case WireFormatLite::WIRETYPE_LENGTH_DELIMITED:
+                if (field.type() == FieldDescriptor::TYPE_MESSAGE) {
+                    int size = EncodedSize(*field.message_type());
+                    if (size >= 0) {
+                        tag += io::CodedOutputStream::VarintSize32(size) + size;
+                        command = &size_constant;
+                    } else {
+                        command = &size_message;
+                    }
+                } else {
+                    command = &size_string;
+                }
+                break;
+
+            case WireFormatLite::WIRETYPE_START_GROUP:
+            case WireFormatLite::WIRETYPE_END_GROUP:
+                // WireFormat::TagSize returns the tag size * two when using groups, to account for both the start and end tag
+                if (EncodedSize(*field.message_type()) >= 0) {
+                    tag += EncodedSize(*field.message_type());
+                    command = &size_constant;
+                } else {
+                    command = &size_group;
+                }
+                break;
+
+            default:
+                throw "Error: Unsupported wire type";// TODO use the proper exception
+        }
+
+        vars["tag"] = SimpleItoa(tag);
+
+        if (field.is_repeated()) {
+            vars["var"] = VariableName(field);
+            repeated_start.Print(printer, vars);
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent(); printer.Indent();
+            }
+
+            vars["var"] = "$v";
+            command->Print(printer, vars);
+
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent(); printer.Outdent();
+            }
+            repeated_end.Print(printer, vars);
+        } else {
+            if (IsLazy(field)) {
+                vars["name"] = VariableName(field);
+                size_raw.Print(printer, vars);
+            }
+            vars["var"] = VariableName(field);
+            single_start.Print(printer, vars);
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Indent();
             }
 
             vars["var"] = "$this->" + VariableName(field);
-            printer.Print(vars, command.c_str());
+            command->Print(printer, vars);
 
             for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
                 printer.Outdent();
@@ -761,25 +1930,71 @@ void PHPCodeGenerator::PrintMessageSize(io::Printer &printer, const Descriptor &
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Outdent();
     }
-    printer.Print(
-        vars,
-        "\n`sp`return $size;\n"
-        "}\n"
-    );
+    size_end.Print(printer, vars);
 }
 
-void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & message) const
+/**
+ * Prints the table describing each field, interpreted by the generic codec
+ * in ProtobufMessage. The codec backs ProtobufMessage::parse() and
+ * serialize() for every message, and all of the methods of messages
+ * optimised for CODE_SIZE.
+ */
+void PHPCodeGenerator::PrintMessageFields(io::Printer &printer, const Descriptor & message) const
 {
+    static const Template field_entry("`number` => array('`name`', Protobuf::TYPE_`type`, `wire`, `flags`, `class`, '`field`'),\n");
+
     map<string, string> vars;
 
-    // Parse the file options.
-    const PHPFileOptions & options (message.file()->options().GetExtension(php));
-    bool skip_unknown = options.skip_unknown();
+    printer.Print(
+        "\n"
+        "// Field number => array(name, type, wire type, flags, class, proto name)\n"
+        "protected static $_fields = array(\n"
+    );
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Indent();
+    }
+    for (int i = 0; i < message.field_count(); ++i) {
+        const FieldDescriptor &field ( *message.field(i) );
 
-    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+        vars["number"] = SimpleItoa(field.number());
+        vars["name"]   = VariableName(field);
+        vars["field"]  = field.name(); // Field masks use the names of the .proto
+        vars["type"]   = UpperString(field.type_name());
+        vars["wire"]   = SimpleItoa(WireFormat::WireTypeForFieldType(field.type()));
 
-    vector<const FieldDescriptor *> required_fields;
+        string flags;
+        if (field.is_repeated()) {
+            flags += " | Protobuf::REPEATED";
+        }
+        if (field.is_packed()) {
+            flags += " | Protobuf::PACKED";
+        }
+        if (field.is_required()) {
+            flags += " | Protobuf::REQUIRED";
+        }
+        if (IsLazy(field)) {
+            flags += " | Protobuf::LAZY";
+        }
+        vars["flags"] = flags.empty() ? "0" : flags.substr(3);
+
+        if (field.type() == FieldDescriptor::TYPE_MESSAGE || field.type() == FieldDescriptor::TYPE_GROUP) {
+            vars["class"] = ClassName(*field.message_type()) + "::class";
+        } else if (field.type() == FieldDescriptor::TYPE_ENUM) {
+            vars["class"] = ClassName(*field.enum_type()) + "::class";
+        } else {
+            vars["class"] = "null";
+        }
 
+        field_entry.Print(printer, vars);
+    }
+    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+        printer.Outdent();
+    }
+    printer.Print(");\n");
+}
+
+void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & message) const
+{
     // Print nested messages.
     for (int i = 0; i < message.nested_type_count(); ++i) {
         printer.Print("\n");
@@ -791,6 +2006,145 @@ void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & mes
         PrintEnum(printer, *message.enum_type(i), false);
     }
 
+    PrintMessageClass(printer, message);
+}
+
+void PHPCodeGenerator::PrintMessageClass(io::Printer &printer, const Descriptor & message) const
+{
+    static const Template required_lazy(
+        "if ($this->`name` === null && $this->`name`Raw === null) {\n"
+        "`sp`return false;\n"
+        "}\n");
+    static const Template required(
+        "if ($this->`name` === null) {\n"
+        "`sp`return false;\n"
+        "}\n");
+    static const Template to_string_enum(
+        "\n`sp`.Protobuf::toString('`name`', `enum`::toString($this->`name`))");
+    static const Template to_string_lazy(
+        "\n`sp`.Protobuf::toString('`name`', $this->get`capitalized_name`())");
+    static const Template to_string(
+        "\n`sp`.Protobuf::toString('`name`', $this->`name`)");
+    static const Template repeated_accessors(
+        "// `comment`"
+        "`sp`protected $`name` = null;\n"
+        "public function clear`capitalized_name`()\n"
+        "{\n"
+        "`sp`$this->`name` = null;\n"
+        "}\n"
+
+        "public function get`capitalized_name`Count()\n"
+        "{\n"
+        "`sp`if ($this->`name` === null) {\n"
+        "`sp``sp`return 0;\n"
+        "`sp`} else {\n"
+        "`sp``sp`return count($this->`name`);\n"
+        "`sp`}\n"
+        "}\n"
+        "public function get`capitalized_name`($index)\n"
+        "{\n"
+        "`sp`return $this->`name`[$index];\n"
+        "}\n"
+        "public function get`capitalized_name`Array()\n"
+        "{\n"
+        "`sp`if ($this->`name` === null) {\n"
+        "`sp``sp`return array();\n"
+        "`sp`} else {\n"
+        "`sp``sp`return $this->`name`;\n"
+        "`sp`}\n"
+        "}\n");
+    static const Template repeated_setters(
+        "public function set`capitalized_name`($index, $value)\n"
+        "{\n"
+        "`sp`$this->`name`[$index] = $value;\n"
+        "}\n"
+        "public function add`capitalized_name`($value)\n"
+        "{\n"
+        "`sp`$this->`name`[] = $value;\n"
+        "}\n"
+        "public function addAll`capitalized_name`(array $values)\n"
+        "{\n"
+        "`sp`foreach ($values as $value) {\n"
+        "`sp``sp`$this->`name`[] = $value;\n"
+        "`sp`}\n"
+        "}\n");
+    static const Template iterate(
+        "public static function iterate`capitalized_name`($source, $chunkSize = 65536)\n"
+        "{\n"
+        "`sp`return self::iterateRepeated($source, `tag`, `class`, $chunkSize);\n"
+        "}\n");
+    static const Template write_stream(
+        "public static function write`capitalized_name`Stream($fp, $items, $chunkSize = 65536)\n"
+        "{\n"
+        "`sp`return self::writeRepeatedStream($fp, `number`, $items, $chunkSize);\n"
+        "}\n");
+    static const Template lazy_accessors(
+        "// `comment`"
+        "`sp`protected $`name` = null;\n"
+        "protected $`name`Raw = null;\n"
+        "public function clear`capitalized_name`()\n"
+        "{\n"
+        "`sp`$this->`name` = null;\n"
+        "`sp`$this->`name`Raw = null;\n"
+        "}\n"
+        "public function has`capitalized_name`()\n"
+        "{\n"
+        "`sp`return $this->`name` !== null || $this->`name`Raw !== null;\n"
+        "}\n"
+
+        "public function get`capitalized_name`()\n"
+        "{\n"
+        "`sp`if ($this->`name`Raw !== null) {\n"
+        "`sp``sp`$this->`name` = new `class`($this->`name`Raw);\n"
+        "`sp``sp`$this->`name`Raw = null;\n"
+        "`sp`}\n"
+        "`sp`if ($this->`name` === null) {\n"
+        "`sp``sp`return `default`;\n"
+        "`sp`} else {\n"
+        "`sp``sp`return $this->`name`;\n"
+        "`sp`}\n"
+        "}\n");
+    static const Template lazy_setter(
+        "public function set`capitalized_name`(`type`$value)\n"
+        "{\n"
+        "`sp`$this->`name` = $value;\n"
+        "`sp`$this->`name`Raw = null;\n"
+        "}\n");
+    static const Template accessors(
+        "// `comment`"
+        "`sp`protected $`name` = null;\n"
+        "public function clear`capitalized_name`()\n"
+        "{\n"
+        "`sp`$this->`name` = null;\n"
+        "}\n"
+        "public function has`capitalized_name`()\n"
+        "{\n"
+        "`sp`return $this->`name` !== null;\n"
+        "}\n"
+
+        "public function get`capitalized_name`()\n"
+        "{\n"
+        "`sp`if ($this->`name` === null) {\n"
+        "`sp``sp`return `default`;\n"
+        "`sp`} else {\n"
+        "`sp``sp`return $this->`name`;\n"
+        "`sp`}\n"
+        "}\n");
+    static const Template setter(
+        "public function set`capitalized_name`(`type`$value)\n"
+        "{\n"
+        "`sp`$this->`name` = $value;\n"
+        "}\n");
+
+    map<string, string> vars;
+
+    // Parse the file options.
+    bool skip_unknown = SkipUnknown(*message.file());
+
+    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+
+    vector<const FieldDescriptor *> required_fields;
+
     // Find out if we are a nested type, if so what kind.
     const FieldDescriptor * parentField = NULL;
     const char * type = "message";
@@ -815,126 +2169,97 @@ void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & mes
                   "full_name", message.full_name()
     );
 
-    printer.Print("class `name`\n{\n",
+    printer.Print("class `name` extends ProtobufMessage\n{\n",
                   "name", ClassName(message)
     );
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Indent();
     }
 
-    // Print fields map
-    /*
-    printer.Print(
-        "// Array maps field indexes to members\n"
-        "protected static $_map = array (\n"
-    );
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Indent();
-    }
-    for (int i = 0; i < message.field_count(); ++i) {
-        const FieldDescriptor &field ( *message.field(i) );
-
-        printer.Print("`index` => '`value`',\n",
-            "index", SimpleItoa(field.number()),
-            "value", VariableName(field)
-        );
-    }
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Outdent();
-    }
-    printer.Print(");\n\n");
-    */
     if (!skip_unknown) {
         printer.Print("protected $unknown;\n");
     }
 
-    // Constructor.
-    printer.Print(
-        vars,
-        "\n" // TODO maybe some kind of inheritance would reduce all this code!
-        "public function __construct($in = null, &$limit = PHP_INT_MAX)\n"
-        "{\n"
-        "`sp`if ($in !== null) {\n"
-        "`sp``sp`if (is_string($in)) {\n"
-        "`sp``sp``sp`$fp = fopen('php://memory', 'r+b');\n"
-        "`sp``sp``sp`fwrite($fp, $in);\n"
-        "`sp``sp``sp`rewind($fp);\n"
-        "`sp``sp`} elseif (is_resource($in)) {\n"
-        "`sp``sp``sp`$fp = $in;\n"
-        "`sp``sp`} else {\n"
-        "`sp``sp``sp`throw new Exception('Invalid in parameter');\n"
-        "`sp``sp`}\n"
-        "`sp``sp`$this->read($fp, $limit);\n"
-        "`sp`}\n"
-        "}\n"
-    );
+    // Every message carries its field table, CODE_SIZE messages leave all
+    // the decoding and encoding to the generic codec.
+    PrintMessageFields(printer, message);
+    if (skip_unknown) {
+        printer.Print("protected static $_skipUnknown = true;\n");
+    }
 
-    // Print the read/write methods.
-    PrintMessageRead(printer, message, required_fields, parentField);
-    PrintMessageWrite(printer, message, parentField);
+    const FileOptions::OptimizeMode optimize_for = message.file()->options().optimize_for();
+    if (optimize_for != FileOptions::CODE_SIZE) {
+        // Print the read/write methods.
+        PrintMessageRead(printer, message, required_fields, parentField);
+        PrintMessageMergeFromString(printer, message, parentField);
+        PrintMessageWrite(printer, message, parentField);
+        PrintMessageSerialize(printer, message);
 
-    PrintMessageSize(printer, message);
+        PrintMessageSize(printer, message);
 
-    // Validate that the required fields are included.
-    printer.Print(
-        "\n"
-        "public function validateRequired()\n"
-        "{\n"
-    );
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Indent();
-    }
-    for (int i = 0; i < required_fields.size(); ++i) {
-        vars["name"] = VariableName(*required_fields[i]);
-        printer.Print(vars,
-            "if ($this->`name` === null) {\n"
-            "`sp`return false;\n"
-            "}\n"
+        // Validate that the required fields are included.
+        printer.Print(
+            "\n"
+            "public function validateRequired()\n"
+            "{\n"
         );
-    }
-    printer.Print("\nreturn true;\n");
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Outdent();
-    }
-    printer.Print("}\n");
+        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+            printer.Indent();
+        }
+        for (int i = 0; i < required_fields.size(); ++i) {
+            vars["name"] = VariableName(*required_fields[i]);
+            if (IsLazy(*required_fields[i])) {
+                required_lazy.Print(printer, vars);
+                continue;
+            }
+            required.Print(printer, vars);
+        }
+        printer.Print("\nreturn true;\n");
+        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+            printer.Outdent();
+        }
+        printer.Print("}\n");
 
-    // Print a toString method.
-    printer.Print(
-        vars,
-        "\n"
-        "public function __toString()\n"
-        "{\n"
-        "`sp`return ''"
-    );
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Indent();
-    }
+        // Print a toString method, lite messages make do with the generic
+        // one they inherit from ProtobufMessage.
+        if (optimize_for != FileOptions::LITE_RUNTIME) {
+            printer.Print(
+                vars,
+                "\n"
+                "public function __toString()\n"
+                "{\n"
+                "`sp`return ''"
+            );
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Indent();
+            }
 
-    if (!skip_unknown) {
-        printer.Print(vars,
-            "\n`sp`.Protobuf::toString('unknown', $this->unknown)");
-    }
+            if (!skip_unknown) {
+                printer.Print(vars,
+                    "\n`sp`.Protobuf::toString('unknown', $this->unknown)");
+            }
 
-    for (int i = 0; i < message.field_count(); ++i) {
-        const FieldDescriptor &field (*message.field(i));
-        vars["name"] = VariableName(field);
+            for (int i = 0; i < message.field_count(); ++i) {
+                const FieldDescriptor &field (*message.field(i));
+                vars["name"] = VariableName(field);
 
-        if (field.type() == FieldDescriptor::TYPE_ENUM) {
-            vars["enum"] = ClassName(*field.enum_type());
-            printer.Print(vars,
-                "\n`sp`.Protobuf::toString('`name`', `enum`::toString($this->`name`))"
-            );
-        } else {
-            printer.Print(vars,
-                "\n`sp`.Protobuf::toString('`name`', $this->`name`)"
-            );
+                if (field.type() == FieldDescriptor::TYPE_ENUM) {
+                    vars["enum"] = ClassName(*field.enum_type());
+                    to_string_enum.Print(printer, vars);
+                } else if (IsLazy(field)) {
+                    vars["capitalized_name"] = UnderscoresToCapitalizedCamelCase(field);
+                    to_string_lazy.Print(printer, vars);
+                } else {
+                    to_string.Print(printer, vars);
+                }
+            }
+            printer.Print(";\n");
+            for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+                printer.Outdent();
+            }
+            printer.Print("}\n");
         }
     }
-    printer.Print(";\n");
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Outdent();
-    }
-    printer.Print("}\n");
 
     // Print fields variables and methods.
     for (int i = 0; i < message.field_count(); ++i) {
@@ -951,6 +2276,7 @@ void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & mes
             size_t p = vars["comment"].find ('{');
             if (p != string::npos) {
                 vars["comment"].resize (p - 1);
+                vars["comment"] += "\n";
             }
         }
 
@@ -973,84 +2299,34 @@ void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & mes
 
         if (field.is_repeated()) {
             // Repeated field.
-            printer.Print(vars,
-                "// `comment`"
-                "`sp`protected $`name` = null;\n"
-                "public function clear`capitalized_name`()\n"
-                "{\n"
-                "`sp`$this->`name` = null;\n"
-                "}\n"
-
-                "public function get`capitalized_name`Count()\n"
-                "{\n"
-                "`sp`if ($this->`name` === null) {\n"
-                "`sp``sp`return 0;\n"
-                "`sp`} else {\n"
-                "`sp``sp`return count($this->`name`);\n"
-                "`sp`}\n"
-                "}\n"
-                "public function get`capitalized_name`($index)\n"
-                "{\n"
-                "`sp`return $this->`name`[$index];\n"
-                "}\n"
-                "public function get`capitalized_name`Array()\n"
-                "{\n"
-                "`sp`if ($this->`name` === null) {\n"
-                "`sp``sp`return array();\n"
-                "`sp`} else {\n"
-                "`sp``sp`return $this->`name`;\n"
-                "`sp`}\n"
-                "}\n"
-            );
+            repeated_accessors.Print(printer, vars);
 
             // TODO Change the set code to validate input depending on the variable type.
-            printer.Print(vars,
-                "public function set`capitalized_name`($index, $value)\n"
-                "{\n"
-                "`sp`$this->`name`[$index] = $value;\n"
-                "}\n"
-                "public function add`capitalized_name`($value)\n"
-                "{\n"
-                "`sp`$this->`name`[] = $value;\n"
-                "}\n"
-                "public function addAll`capitalized_name`(array $values)\n"
-                "{\n"
-                "`sp`foreach ($values as $value) {\n"
-                "`sp``sp`$this->`name`[] = $value;\n"
-                "`sp`}\n"
-                "}\n"
-            );
+            repeated_setters.Print(printer, vars);
+
+            // The elements of the repeated fields of a root message can be
+            // decoded and encoded one at a time, without keeping the whole array.
+            if (message.containing_type() == NULL) {
+                if (field.type() == FieldDescriptor::TYPE_MESSAGE) {
+                    vars["tag"] = SimpleItoa(WireFormatLite::MakeTag(field.number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED));
+                    vars["class"] = ClassName(*field.message_type()) + "::class";
+                    iterate.Print(printer, vars);
+                }
+                vars["number"] = SimpleItoa(field.number());
+                write_stream.Print(printer, vars);
+            }
+        } else if (IsLazy(field)) {
+            // Non repeated field, decoded from its raw bytes on first access.
+            vars["class"] = ClassName(*field.message_type());
+            lazy_accessors.Print(printer, vars);
+
+            lazy_setter.Print(printer, vars);
         } else {
             // Non repeated field.
-            printer.Print(vars,
-                "// `comment`"
-                "`sp`protected $`name` = null;\n"
-                "public function clear`capitalized_name`()\n"
-                "{\n"
-                "`sp`$this->`name` = null;\n"
-                "}\n"
-                "public function has`capitalized_name`()\n"
-                "{\n"
-                "`sp`return $this->`name` !== null;\n"
-                "}\n"
-
-                "public function get`capitalized_name`()\n"
-                "{\n"
-                "`sp`if ($this->`name` === null) {\n"
-                "`sp``sp`return `default`;\n"
-                "`sp`} else {\n"
-                "`sp``sp`return $this->`name`;\n"
-                "`sp`}\n"
-                "}\n"
-            );
+            accessors.Print(printer, vars);
 
             // TODO Change the set code to validate input depending on the variable type.
-            printer.Print(vars,
-                "public function set`capitalized_name`(`type`$value)\n"
-                "{\n"
-                "`sp`$this->`name` = $value;\n"
-                "}\n"
-            );
+            setter.Print(printer, vars);
         }
     }
 
@@ -1069,14 +2345,14 @@ void PHPCodeGenerator::PrintMessage(io::Printer &printer, const Descriptor & mes
 
 void PHPCodeGenerator::PrintEnum(io::Printer &printer, const EnumDescriptor & e, bool is_last) const
 {
-    map<string, string> vars;
-
-    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+    // The lite runtime has no use for the value names.
+    bool lite = e.file()->options().optimize_for() == FileOptions::LITE_RUNTIME;
 
     printer.Print("// enum `full_name`\n"
-                  "class `name`\n{\n",
+                  "class `name``extends`\n{\n",
                   "full_name", e.full_name(),
-                  "name", ClassName(e)
+                  "name", ClassName(e),
+                  "extends", lite ? "" : " extends ProtobufEnum"
     );
 
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
@@ -1094,40 +2370,26 @@ void PHPCodeGenerator::PrintEnum(io::Printer &printer, const EnumDescriptor & e,
         );
     }
 
-    // Print values array.
-    printer.Print("\npublic static $values = array(\n");
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Indent();
-    }
-    for (int j = 0; j < e.value_count(); ++j) {
-        const EnumValueDescriptor &value ( *e.value(j) );
+    // Print values array, used by ProtobufEnum::toString().
+    if (!lite) {
+        printer.Print("\npublic static $values = array(\n");
+        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+            printer.Indent();
+        }
+        for (int j = 0; j < e.value_count(); ++j) {
+            const EnumValueDescriptor &value ( *e.value(j) );
 
-        printer.Print(
-            "`number` => self::`name`,\n",
-            "number", SimpleItoa(value.number()),
-            "name", UpperString(value.name())
-        );
-    }
-    for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
-        printer.Outdent();
+            printer.Print(
+                "`number` => self::`name`,\n",
+                "number", SimpleItoa(value.number()),
+                "name", UpperString(value.name())
+            );
+        }
+        for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
+            printer.Outdent();
+        }
+        printer.Print(");\n");
     }
-    printer.Print(");\n\n");
-
-    // Print a toString.
-    printer.Print(
-        vars,
-        "public static function toString($value)\n"
-        "{\n"
-        "`sp`if (is_null($value)) {\n"
-        "`sp``sp`return null;\n"
-        "`sp`}\n"
-        "`sp`if (array_key_exists($value, self::$values)) {\n"
-        "`sp``sp`return self::$values[$value];\n"
-        "`sp`}\n"
-        "\n"
-        "`sp`return 'UNKNOWN';\n"
-        "}\n"
-    );
 
     for (int i = 0; i < STYLE_NB_SPACES / 2; ++i) {
         printer.Outdent();
@@ -1163,50 +2425,573 @@ void PHPCodeGenerator::PrintServices(io::Printer &printer, const FileDescriptor
     }
 }
 
-bool PHPCodeGenerator::Generate(const FileDescriptor* file,
-                const string& parameter,
-                OutputDirectory* output_directory,
-                string* error) const
+bool PHPCodeGenerator::ParseOptions(const string & parameter, GeneratorOptions * options, string * error) const
 {
-    string php_filename (file->name() + ".php");
+    vector<pair<string, string> > params;
+    ParseGeneratorParameter(parameter, &params);
+
+    for (int i = 0; i < params.size(); ++i) {
+        const string & key (params[i].first);
+        const string & value (params[i].second);
+
+        if (key == "jobs") {
+            char * end;
+            int32 jobs = strto32(value.c_str(), &end, 10);
+            if (value.empty() || *end != '\0' || jobs < 0) {
+                error->assign("Invalid jobs option: " + value);
+                return false;
+            }
+            options->jobs = jobs;
+        } else if (key == "cache_dir") {
+            options->cache_dir = value;
+        } else if (key == "preload") {
+            options->preload = true;
+            if (!value.empty()) {
+                options->preload_runtime = value;
+            }
+        } else if (key == "psr4") {
+            options->psr4 = true;
+            options->output_parameter += "psr4,";
+        } else {
+            error->assign("Unknown option: " + key);
+            return false;
+        }
+    }
+
+    return true;
+}
 
-    // Parse the options.
-    const PHPFileOptions & options (file->options().GetExtension(php));
-    const string & namespace_ (options.namespace_());
+void PHPCodeGenerator::PrintHeader(io::Printer &printer, const FileDescriptor & file, const string & filename) const
+{
+    const string & namespace_ (file.options().GetExtension(php).namespace_());
 
-    // Generate main file.
-    scoped_ptr<io::ZeroCopyOutputStream> output(
-        output_directory->Open(php_filename)
+    printer.Print(
+        "<?php\n"
+        "// Please include the below file before `filename`\n"
+        "//require('protocolbuffers.inc.php');\n",
+        "filename", filename.c_str()
     );
 
-    io::Printer printer(output.get(), '`');
+    if (!namespace_.empty()) {
+        printer.Print("namespace `ns`;\n\n", "ns", namespace_.c_str());
+    }
+
+    printer.Print(
+        "use Exception;\n"
+        "use Protobuf;\n"
+        "use ProtobufEnum;\n"
+        "use ProtobufMessage;\n\n"
+    );
+}
 
+bool PHPCodeGenerator::GenerateFile(const FileDescriptor * file, const GeneratorOptions & options, vector<GeneratedFile> * outputs, string * error) const
+{
     try {
+        if (options.psr4) {
+            GenerateClassFiles(*file, outputs);
+            return true;
+        }
+
+        GeneratedFile output;
+        output.name = file->name() + ".php";
+        {
+            io::StringOutputStream stream(&output.content);
+            io::Printer printer(&stream, '`');
+
+            PrintHeader   (printer, *file, output.name);
+            PrintMessages (printer, *file);
+            PrintEnums    (printer, *file);
+            PrintServices (printer, *file);
+        }
+        outputs->push_back(output);
+
+    } catch (const char *msg) {
+        error->assign( msg );
+        return false;
+    }
+
+    return true;
+}
+
+// Map a namespace and class into a path, e.g. Foo\Bar\Baz into Foo/Bar/Baz.php.
+template <class DescriptorType>
+string PHPCodeGenerator::ClassFilename(const DescriptorType & descriptor) const
+{
+    string path (descriptor.file()->options().GetExtension(php).namespace_());
+    replace(path.begin(), path.end(), '\\', '/');
+    if (!path.empty()) {
+        path += "/";
+    }
+    return path + ClassName(descriptor) + ".php";
+}
+
+void PHPCodeGenerator::GenerateClassFiles(const FileDescriptor & file, vector<GeneratedFile> * outputs) const
+{
+    for (int i = 0; i < file.message_type_count(); ++i) {
+        GenerateMessageFiles(*file.message_type(i), outputs);
+    }
+    for (int i = 0; i < file.enum_type_count(); ++i) {
+        GenerateEnumFile(*file.enum_type(i), outputs);
+    }
+    GenerateAutoloader(file, outputs);
+}
+
+// Nested types come first, in the same order as PrintMessage() prints them.
+void PHPCodeGenerator::GenerateMessageFiles(const Descriptor & message, vector<GeneratedFile> * outputs) const
+{
+    for (int i = 0; i < message.nested_type_count(); ++i) {
+        GenerateMessageFiles(*message.nested_type(i), outputs);
+    }
+    for (int i = 0; i < message.enum_type_count(); ++i) {
+        GenerateEnumFile(*message.enum_type(i), outputs);
+    }
+
+    GeneratedFile output;
+    output.name = ClassFilename(message);
+    {
+        io::StringOutputStream stream(&output.content);
+        io::Printer printer(&stream, '`');
+
+        PrintHeader(printer, *message.file(), output.name);
+        PrintMessageClass(printer, message);
+    }
+    // Drop the blank line separating the class from the next one.
+    output.content.erase(output.content.size() - 1);
+    outputs->push_back(output);
+}
+
+void PHPCodeGenerator::GenerateEnumFile(const EnumDescriptor & e, vector<GeneratedFile> * outputs) const
+{
+    GeneratedFile output;
+    output.name = ClassFilename(e);
+    {
+        io::StringOutputStream stream(&output.content);
+        io::Printer printer(&stream, '`');
+
+        PrintHeader(printer, *e.file(), output.name);
+        PrintEnum(printer, e, true);
+    }
+    outputs->push_back(output);
+}
+
+/**
+ * With psr4 the file named after the .proto holds the classmap of all the
+ * classes generated from it, and an autoloader requiring them on first use.
+ */
+void PHPCodeGenerator::GenerateAutoloader(const FileDescriptor & file, vector<GeneratedFile> * outputs) const
+{
+    map<string, string> vars;
+    const string & namespace_ (file.options().GetExtension(php).namespace_());
+
+    vars["sp"] = string(STYLE_NB_SPACES, ' ');
+
+    GeneratedFile output;
+    output.name = file.name() + ".php";
+
+    // The class files are relative to the output directory, not to this file.
+    string root;
+    for (int i = 0; i < output.name.size(); ++i) {
+        if (output.name[i] == '/') {
+            root += "/..";
+        }
+    }
+    vars["root"] = root.empty() ? "__DIR__" : "__DIR__.'" + root + "'";
+
+    {
+        io::StringOutputStream stream(&output.content);
+        io::Printer printer(&stream, '`');
+
         printer.Print(
             "<?php\n"
             "// Please include the below file before `filename`\n"
-            "//require('protocolbuffers.inc.php');\n",
-            "filename", php_filename.c_str()
+            "//require('protocolbuffers.inc.php');\n"
+            "\n"
+            "// The classes generated from `proto` are each in their own file, loaded on first use.\n",
+            "filename", output.name,
+            "proto", file.name()
+        );
+        printer.Print(vars,
+            "spl_autoload_register(function ($class) {\n"
+            "`sp`static $classmap = array(\n"
+        );
+        for (int i = 0; i < STYLE_NB_SPACES; ++i) {
+            printer.Indent();
+        }
+        for (int i = 0; i < outputs->size(); ++i) {
+            // Class files are named after their class, see ClassFilename().
+            const string & name ((*outputs)[i].name);
+            string class_name (name.substr(0, name.size() - 4));
+            class_name = class_name.substr(class_name.rfind('/') + 1);
+            if (!namespace_.empty()) {
+                class_name = namespace_ + "\\" + class_name;
+            }
+            vars["class"] = StringReplace(class_name, "\\", "\\\\", true);
+            vars["file"] = name;
+            printer.Print(vars, "'`class`' => '/`file`',\n");
+        }
+        for (int i = 0; i < STYLE_NB_SPACES; ++i) {
+            printer.Outdent();
+        }
+        printer.Print(vars,
+            "`sp`);\n"
+            "`sp`if (isset($classmap[$class])) {\n"
+            "`sp``sp`require `root`.$classmap[$class];\n"
+            "`sp`}\n"
+            "});\n"
         );
+    }
+    outputs->push_back(output);
+}
+
+// Copy a rendered file into the output directory.
+void WriteFile(OutputDirectory* output_directory, const string & filename, const string & content)
+{
+    scoped_ptr<io::ZeroCopyOutputStream> output(
+        output_directory->Open(filename)
+    );
+    io::CodedOutputStream coded(output.get());
+    coded.WriteRaw(content.data(), content.size());
+}
+
+// Read a whole file, returns false if it can't be read.
+bool ReadWholeFile(const string & path, string * content)
+{
+    FILE * fp = fopen(path.c_str(), "rb");
+    if (fp == NULL) {
+        return false;
+    }
+
+    content->clear();
+    char buf[65536];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        content->append(buf, len);
+    }
+    bool ok = !ferror(fp);
+    fclose(fp);
+
+    return ok;
+}
+
+// Write a file under a temporary name, then rename it into place, so that
+// other processes sharing the file never see it half written.
+bool WriteFileAtomically(const string & path, const string & content)
+{
+    string tmp (path + ".XXXXXX");
+    vector<char> name (tmp.begin(), tmp.end());
+    name.push_back('\0');
+
+    int fd = mkstemp(&name[0]);
+    if (fd == -1) {
+        return false;
+    }
+    fchmod(fd, 0644);
+
+    FILE * fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        unlink(&name[0]);
+        return false;
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), fp) == content.size();
+    ok = fclose(fp) == 0 && ok;
+
+    if (!ok || rename(&name[0], path.c_str()) != 0) {
+        unlink(&name[0]);
+        return false;
+    }
+
+    return true;
+}
+
+// Cache entries hold every file generated from a .proto, as a list of
+// "<length>:<name><length>:<content>" records.
+string EncodeCacheEntry(const vector<GeneratedFile> & files)
+{
+    string entry;
+    for (int i = 0; i < files.size(); ++i) {
+        entry += SimpleItoa(files[i].name.size()) + ":" + files[i].name;
+        entry += SimpleItoa(files[i].content.size()) + ":" + files[i].content;
+    }
+    return entry;
+}
+
+// Read one "<length>:<data>" record, returns false if the entry is corrupt.
+bool DecodeCacheRecord(const string & entry, size_t * pos, string * data)
+{
+    size_t colon = entry.find(':', *pos);
+    if (colon == string::npos || colon == *pos) {
+        return false;
+    }
+    char * end;
+    unsigned long len = strtoul(entry.c_str() + *pos, &end, 10);
+    if (end != entry.c_str() + colon || len > entry.size() - colon - 1) {
+        return false;
+    }
+    data->assign(entry, colon + 1, len);
+    *pos = colon + 1 + len;
+    return true;
+}
 
-        if (!namespace_.empty()) {
-            printer.Print("namespace `ns`;\n\n", "ns", namespace_.c_str());
+bool DecodeCacheEntry(const string & entry, vector<GeneratedFile> * files)
+{
+    files->clear();
+    size_t pos = 0;
+    while (pos < entry.size()) {
+        GeneratedFile file;
+        if (!DecodeCacheRecord(entry, &pos, &file.name) || !DecodeCacheRecord(entry, &pos, &file.content)) {
+            return false;
         }
+        files->push_back(file);
+    }
+    return !files->empty();
+}
 
-        printer.Print(
-            "use Exception;\n"
-            "use Protobuf;\n\n"
-        );
+// 64 bit FNV-1a, the string is length prefixed so that fields can't run into each other.
+uint64 HashString(uint64 hash, const string & s)
+{
+    const string data (SimpleItoa(s.size()) + ":" + s);
+    for (int i = 0; i < data.size(); ++i) {
+        hash ^= (uint8) data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * The generated code depends on the file, on the names and options of the
+ * types it imports, on the options of the plugin and on the version of the
+ * plugin and of libprotobuf it was built with.
+ */
+string PHPCodeGenerator::CacheKey(const FileDescriptor * file, const GeneratorOptions & options) const
+{
+    uint64 hash = 14695981039346656037ULL;
+    hash = HashString(hash, GENERATOR_VERSION);
+    // The comments copied from the .proto are formatted by libprotobuf.
+    hash = HashString(hash, SimpleItoa(GOOGLE_PROTOBUF_VERSION));
+    hash = HashString(hash, options.output_parameter);
+
+    // Walk the file and all its transitive dependencies.
+    vector<const FileDescriptor *> files (1, file);
+    set<const FileDescriptor *> seen (files.begin(), files.end());
+    for (int i = 0; i < files.size(); ++i) {
+        FileDescriptorProto proto;
+        files[i]->CopyTo(&proto);
+
+        string data;
+        proto.SerializeToString(&data);
+        hash = HashString(hash, data);
+
+        for (int j = 0; j < files[i]->dependency_count(); ++j) {
+            if (seen.insert(files[i]->dependency(j)).second) {
+                files.push_back(files[i]->dependency(j));
+            }
+        }
+    }
 
-        PrintMessages (printer, *file);
-        PrintEnums    (printer, *file);
-        PrintServices (printer, *file);
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+    return key;
+}
 
-    } catch (const char *msg) {
-        error->assign( msg );
+void PHPCodeGenerator::GenerateJobOutput(GenerateJob & job, const GeneratorOptions & options) const
+{
+    job.cached = false;
+    if (options.cache_dir.empty()) {
+        job.ok = GenerateFile(job.file, options, &job.outputs, &job.error);
+        return;
+    }
+
+    const string path (options.cache_dir + "/" + CacheKey(job.file, options));
+    string entry;
+    if (ReadWholeFile(path, &entry) && DecodeCacheEntry(entry, &job.outputs)) {
+        job.cached = true;
+        job.ok = true;
+        return;
+    }
+
+    job.outputs.clear();
+    job.ok = GenerateFile(job.file, options, &job.outputs, &job.error);
+    if (job.ok) {
+        // A cache we can't write to only costs us speed.
+        WriteFileAtomically(path, EncodeCacheEntry(job.outputs));
+    }
+}
+
+// Append the index of file's job to order, after those of the files it imports.
+void OrderByDependencies(const FileDescriptor * file, const map<const FileDescriptor *, int> & jobs,
+                set<const FileDescriptor *> * seen, vector<int> * order)
+{
+    if (!seen->insert(file).second) {
+        return;
+    }
+    for (int i = 0; i < file->dependency_count(); ++i) {
+        OrderByDependencies(file->dependency(i), jobs, seen, order);
+    }
+
+    map<const FileDescriptor *, int>::const_iterator job = jobs.find(file);
+    if (job != jobs.end()) {
+        order->push_back(job->second);
+    }
+}
+
+/**
+ * The runtime is required, as it declares ProtobufPrimitives at run time,
+ * then every generated file is compiled. Files come after the files they
+ * import, and nested types before their parents, so every class is
+ * compiled after the classes it uses.
+ */
+void PHPCodeGenerator::GeneratePreload(const vector<GenerateJob> & jobs, const GeneratorOptions & options, GeneratedFile * output) const
+{
+    map<const FileDescriptor *, int> index;
+    for (int i = 0; i < jobs.size(); ++i) {
+        index[jobs[i].file] = i;
+    }
+    set<const FileDescriptor *> seen;
+    vector<int> order;
+    for (int i = 0; i < jobs.size(); ++i) {
+        OrderByDependencies(jobs[i].file, index, &seen, &order);
+    }
+
+    output->name = "preload.php";
+    io::StringOutputStream stream(&output->content);
+    io::Printer printer(&stream, '`');
+
+    const string & runtime (options.preload_runtime);
+    printer.Print(
+        "<?php\n"
+        "// Set opcache.preload to this file to compile the generated classes once, at startup.\n"
+        "require_once `runtime`;\n"
+        "\n",
+        "runtime", runtime[0] == '/' ? "'" + runtime + "'" : "__DIR__.'/" + runtime + "'"
+    );
+    for (int i = 0; i < order.size(); ++i) {
+        const vector<GeneratedFile> & outputs (jobs[order[i]].outputs);
+        for (int j = 0; j < outputs.size(); ++j) {
+            printer.Print("opcache_compile_file(__DIR__.'/`file`');\n", "file", outputs[j].name);
+        }
+    }
+}
+
+bool PHPCodeGenerator::Generate(const FileDescriptor* file,
+                const string& parameter,
+                OutputDirectory* output_directory,
+                string* error) const
+{
+    // The plugin main of libprotoc 3.0.0 and later calls GenerateAll() with all
+    // the files, older versions call this once per file, so the preload script
+    // would be written again for every file.
+    GeneratorOptions options;
+    if (!ParseOptions(parameter, &options, error)) {
+        return false;
+    }
+    if (options.preload) {
+        error->assign("preload needs all the files at once, which the plugin only gets when built against protobuf 3.0.0 or later");
+        return false;
+    }
+
+    vector<const FileDescriptor*> files (1, file);
+    return GenerateAll(files, parameter, output_directory, error);
+}
+
+void * PHPCodeGenerator::GenerateWorker(void * arg)
+{
+    GeneratePool & pool (*static_cast<GeneratePool *>(arg));
+
+    while (true) {
+        pthread_mutex_lock(&pool.lock);
+        size_t i = pool.next++;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (i >= pool.jobs->size()) {
+            break;
+        }
+
+        pool.generator->GenerateJobOutput((*pool.jobs)[i], *pool.options);
+    }
+
+    return NULL;
+}
+
+/**
+ * Renders the files on a pool of threads, each into its own buffer, then
+ * writes them out in the order protoc gave them, so the output does not
+ * depend on which thread finished first.
+ */
+bool PHPCodeGenerator::GenerateAll(const vector<const FileDescriptor*>& files,
+                const string& parameter,
+                OutputDirectory* output_directory,
+                string* error) const
+{
+    GeneratorOptions options;
+    if (!ParseOptions(parameter, &options, error)) {
         return false;
     }
 
+    if (!options.cache_dir.empty()) {
+        mkdir(options.cache_dir.c_str(), 0755); // Fine if it already exists
+    }
+
+    vector<GenerateJob> jobs (files.size());
+    for (int i = 0; i < files.size(); ++i) {
+        jobs[i].file = files[i];
+        jobs[i].ok = false;
+    }
+
+    long threads = options.jobs;
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    threads = min<long>(threads, jobs.size());
+
+    GeneratePool pool;
+    pool.generator = this;
+    pool.options = &options;
+    pool.jobs = &jobs;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // This thread works too, if a worker fails to start the others pick up its share.
+    vector<pthread_t> workers;
+    for (long i = 1; i < threads; ++i) {
+        pthread_t worker;
+        if (pthread_create(&worker, NULL, GenerateWorker, &pool) == 0) {
+            workers.push_back(worker);
+        }
+    }
+    GenerateWorker(&pool);
+    for (int i = 0; i < workers.size(); ++i) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    int hits = 0;
+    for (int i = 0; i < jobs.size(); ++i) {
+        if (!jobs[i].ok) {
+            error->assign(jobs[i].file->name() + ": " + jobs[i].error);
+            return false;
+        }
+        if (jobs[i].cached) {
+            hits++;
+        }
+    }
+    for (int i = 0; i < jobs.size(); ++i) {
+        for (int j = 0; j < jobs[i].outputs.size(); ++j) {
+            WriteFile(output_directory, jobs[i].outputs[j].name, jobs[i].outputs[j].content);
+        }
+    }
+
+    if (options.preload) {
+        GeneratedFile preload;
+        GeneratePreload(jobs, options, &preload);
+        WriteFile(output_directory, preload.name, preload.content);
+    }
+
+    if (!options.cache_dir.empty()) {
+        fprintf(stderr, "protoc-gen-php: cache: %d hits, %d misses\n",
+            hits, (int) jobs.size() - hits);
+    }
+
     return true;
 }
 
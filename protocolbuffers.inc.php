@@ -9,370 +9,1327 @@ class ProtobufEnum
         if (is_null($value)) {
             return null;
         }
-        if (array_key_exists($value, self::$values)) {
-            return self::$values[$value];
+        if (array_key_exists($value, static::$values)) {
+            return static::$values[$value];
         }
 
         return 'UNKNOWN';
     }
 }
 
+/**
+ * Base class of the generated messages.
+ *
+ * Every message declares a static table of its fields, which the generic
+ * codec below interprets. Messages optimised for SPEED or LITE_RUNTIME
+ * override the codec methods with code unrolled for their fields, but can
+ * still be decoded and encoded by the codec with parse() and serialize().
+ */
 class ProtobufMessage
 {
-    function __construct($fp = null, &$limit = PHP_INT_MAX)
+    // Field number => array(name, type, wire type, flags, class, proto name)
+    protected static $_fields = array();
+
+    // Skip unknown fields, instead of keeping them in $unknown
+    protected static $_skipUnknown = false;
+
+    protected $cachedSize = null;
+
+    public function __construct($in = null, &$limit = PHP_INT_MAX, array $mask = null)
     {
-        if ($fp !== null) {
-            if (is_string($fp)) {
-                // If the input is a string, turn it into a stream and decode it.
-                $str = $fp;
-                $fp = fopen('php://memory', 'r+b');
-                fwrite($fp, $str);
-                rewind($fp);
+        if ($in !== null) {
+            if ($mask !== null) {
+                $mask = Protobuf::compileMask($mask);
             }
-            $this->read($fp, $limit);
-            if (isset($str)) {
-                fclose($fp);
+            if (is_string($in)) {
+                // If the input is a string, decode it in place.
+                $pos = 0;
+                $this->mergeFromString($in, $pos, min(strlen($in), $limit), $mask);
+                $limit -= $pos;
+            } elseif (is_resource($in)) {
+                $this->read($in, $limit, $mask);
+            } else {
+                throw new Exception('Invalid in parameter');
             }
         }
     }
-}
 
-/**
- * Class to aid in the parsing and creating of Protocol Buffer Messages.
- * This class should be included by the developer before they use a
- * generated protobuf class.
- *
- * @author Andrew Brampton
- */
-class Protobuf
-{
-    const TYPE_DOUBLE   = 1;  // double, exactly eight bytes on the wire.
-    const TYPE_FLOAT    = 2;  // float, exactly four bytes on the wire.
-    const TYPE_INT64    = 3;  // int64, varint on the wire.  Negative numbers
-                              // take 10 bytes.  Use TYPE_SINT64 if negative
-                              // values are likely.
-    const TYPE_UINT64   = 4;  // uint64, varint on the wire.
-    const TYPE_INT32    = 5;  // int32, varint on the wire.  Negative numbers
-                              // take 10 bytes.  Use TYPE_SINT32 if negative
-                              // values are likely.
-    const TYPE_FIXED64  = 6;  // uint64, exactly eight bytes on the wire.
-    const TYPE_FIXED32  = 7;  // uint32, exactly four bytes on the wire.
-    const TYPE_BOOL     = 8;  // bool, varint on the wire.
-    const TYPE_STRING   = 9;  // UTF-8 text.
-    const TYPE_GROUP    = 10; // Tag-delimited message.  Deprecated.
-    const TYPE_MESSAGE  = 11; // Length-delimited message.
-
-    const TYPE_BYTES    = 12; // Arbitrary byte array.
-    const TYPE_UINT32   = 13; // uint32, varint on the wire
-    const TYPE_ENUM     = 14; // Enum, varint on the wire
-    const TYPE_SFIXED32 = 15; // int32, exactly four bytes on the wire
-    const TYPE_SFIXED64 = 16; // int64, exactly eight bytes on the wire
-    const TYPE_SINT32   = 17; // int32, ZigZag-encoded varint on the wire
-    const TYPE_SINT64   = 18; // int64, ZigZag-encoded varint on the wire
+    /**
+     * Decodes only the fields listed in the mask, e.g. array('name', 'phone.number').
+     */
+    public static function parseWithMask($in, array $mask)
+    {
+        $limit = PHP_INT_MAX;
+        return new static($in, $limit, $mask);
+    }
 
     /**
-     * Returns a string representing this wiretype.
+     * Decodes a message from a string or a stream with the generic codec.
      */
-    public static function getWiretype($wireType)
+    public static function parse($in, array $mask = null)
     {
-        switch ($wireType) {
-            case 0:
-                return 'varint';
-            case 1:
-                return '64-bit';
-            case 2:
-                return 'length-delimited';
-            case 3:
-                return 'group start';
-            case 4:
-                return 'group end';
-            case 5:
-                return '32-bit';
-            default:
-                return 'unknown';
+        if ($mask !== null) {
+            $mask = Protobuf::compileMask($mask);
+        }
+        if (is_resource($in)) {
+            $in = stream_get_contents($in);
+        }
+        if (!is_string($in)) {
+            throw new Exception('Invalid in parameter');
         }
+        $message = new static();
+        $pos = 0;
+        $message->parseFields($in, $pos, strlen($in), $mask);
+        return $message;
     }
 
     /**
-     * Returns how big (in bytes) this number would be as a varint.
+     * Encodes the message to a string with the generic codec.
      */
-    public static function sizeVarint($i)
+    public function serialize()
     {
-        /*$len = 0;
-        do {
-            $i = $i >> 7;
-            $len++;
-        } while ($i != 0);
+        $this->sizeFields();
+        $out = '';
+        $this->serializeFields($out);
+        return $out;
+    }
 
-        return $len;*/
+    /**
+     * Computing the size first caches the size of every nested message,
+     * so that writeWithCachedSizes() never has to size them again.
+     */
+    public function write($fp)
+    {
+        $this->size();
+        $this->writeWithCachedSizes($fp);
+    }
 
-        // TODO Change to a binary search.
-        if ($i < 0x80) {
-            return 1;
-        }
-        if ($i < 0x4000) {
-            return 2;
-        }
-        if ($i < 0x200000) {
-            return 3;
-        }
-        if ($i < 0x10000000) {
-            return 4;
+    public function serializeToString()
+    {
+        $out = '';
+        $this->serializeTo($out);
+        return $out;
+    }
+
+    public function serializeTo(&$out)
+    {
+        $this->size();
+        $this->serializeWithCachedSizes($out);
+    }
+
+    /**
+     * Writes the message to $fp prefixed with its length as a varint.
+     */
+    public function writeDelimitedTo($fp)
+    {
+        $out = Protobuf::encodeVarint($this->size());
+        $this->serializeWithCachedSizes($out);
+        fwrite($fp, $out);
+    }
+
+    /**
+     * Writes each message of the array or Traversable $messages to $fp
+     * prefixed with its length, in writes of about $chunkSize bytes.
+     *
+     * @return int The number of messages written
+     */
+    public static function writeDelimitedMany($fp, $messages, $chunkSize = 65536)
+    {
+        $out = '';
+        $n = 0;
+        foreach ($messages as $message) {
+            $out .= Protobuf::encodeVarint($message->size());
+            $message->serializeWithCachedSizes($out);
+            $n++;
+            if (strlen($out) >= $chunkSize) {
+                fwrite($fp, $out);
+                $out = '';
+            }
         }
-        if ($i < 0x800000000) {
-            return 5;
+        if ($out !== '') {
+            fwrite($fp, $out);
         }
-        if ($i < 0x40000000000) {
-            return 6;
+
+        return $n;
+    }
+
+    /**
+     * Reads the next message prefixed with its length from $fp, or returns
+     * null at the end of the stream. Only the message itself is read, so
+     * the stream can be shared with other readers.
+     */
+    public static function parseDelimitedFrom($fp, array $mask = null)
+    {
+        $len = Protobuf::readVarint($fp);
+        if ($len === false) {
+            return null;
         }
-        if ($i < 0x2000000000000) {
-            return 7;
+        $buf = $len > 0 ? stream_get_contents($fp, $len) : '';
+        if ($buf === false || strlen($buf) !== $len) {
+            throw new Exception('Unexpected end of stream');
         }
-        if ($i < 0x100000000000000) {
-            return 8;
+        return new static($buf, $len, $mask);
+    }
+
+    /**
+     * Yields the messages prefixed with their length from $fp, one at a
+     * time. The stream is read in chunks of $chunkSize bytes, and only the
+     * chunk and the message being decoded are held in memory.
+     */
+    public static function parseDelimitedStream($fp, $chunkSize = 65536, array $mask = null)
+    {
+        if ($mask !== null) {
+            $mask = Protobuf::compileMask($mask);
         }
-        if ($i < 0x8000000000000000) {
-            return 9;
+        $reader = new ProtobufChunkedReader($fp, $chunkSize);
+        while (($len = $reader->readVarint()) !== false) {
+            if (!$reader->fill($len)) {
+                throw new Exception('Unexpected end of stream');
+            }
+            $message = new static();
+            $end = $reader->pos + $len;
+            $message->mergeFromString($reader->buf, $reader->pos, $end, $mask);
+            if ($reader->pos !== $end) {
+                throw new Exception('Message did not end at its length');
+            }
+            yield $message;
         }
     }
 
     /**
-     * Tries to read a varint from $fp.
-     *
-     * @throws Exception
-     *
-     * @return int|bool Varint from the stream, or false if the stream has reached eof.
+     * Yields the elements of the repeated message field with tag $tag of the
+     * message in $source, a string or a stream, as instances of $class. They
+     * are decoded one at a time, and every other field is skipped. A stream
+     * is read in chunks of $chunkSize bytes, so only the chunk and the
+     * element being decoded are held in memory.
      */
-    public static function readVarint($fp, &$limit = null)
+    protected static function iterateRepeated($source, $tag, $class, $chunkSize)
     {
-        $value = '';
-        $len = 0;
-        do { // Keep reading until we find the last byte.
-            $b = fread($fp, 1);
-            if ($b === false) {
-                throw new Exception("readVarint(): Error reading byte");
+        if (is_string($source)) {
+            $pos = 0;
+            $end = strlen($source);
+            while ($pos < $end) {
+                $t = Protobuf::readVarintFromString($source, $pos);
+                if ($t !== $tag) {
+                    Protobuf::skipFieldFromString($source, $pos, $t & 0x07);
+                    continue;
+                }
+                $len = Protobuf::readVarintFromString($source, $pos);
+                $stop = $pos + $len;
+                if ($stop > $end) {
+                    throw new Exception('Unexpected end of buffer');
+                }
+                $message = new $class();
+                $message->mergeFromString($source, $pos, $stop);
+                if ($pos !== $stop) {
+                    throw new Exception('Message did not end at its length');
+                }
+                yield $message;
             }
-            if (strlen($b) < 1) {
-                break;
+            if ($pos > $end) {
+                throw new Exception('Unexpected end of buffer');
             }
+            return;
+        }
 
-            $value .= $b;
-            $len++;
-        } while ($b >= "\x80");
-
-        if ($len == 0) {
-            if (feof($fp)) {
-                return false;
+        if (!is_resource($source)) {
+            throw new Exception('Invalid source parameter');
+        }
+        $reader = new ProtobufChunkedReader($source, $chunkSize);
+        while (($t = $reader->readVarint()) !== false) {
+            if ($t !== $tag) {
+                $reader->skipField($t & 0x07);
+                continue;
+            }
+            $len = $reader->readVarint();
+            if ($len === false || !$reader->fill($len)) {
+                throw new Exception('Unexpected end of stream');
             }
-            throw new Exception("readVarint(): Error reading byte");
+            $message = new $class();
+            $end = $reader->pos + $len;
+            $message->mergeFromString($reader->buf, $reader->pos, $end);
+            if ($reader->pos !== $end) {
+                throw new Exception('Message did not end at its length');
+            }
+            yield $message;
         }
+    }
 
-        if ($limit !== null) {
-            $limit -= $len;
+    /**
+     * Writes the elements of the array or Traversable $items to $fp as the
+     * repeated field $number, in writes of about $chunkSize bytes. Fields
+     * may come in any order, so this can follow the rest of the message
+     * written by write() with the field left empty. Packed fields are
+     * written as one packed run per write, which decoders concatenate.
+     *
+     * @return int The number of elements written
+     */
+    protected static function writeRepeatedStream($fp, $number, $items, $chunkSize)
+    {
+        list($name, $type, $wire, $flags) = static::$_fields[$number];
+        $packed = ($flags & Protobuf::PACKED) != 0;
+        $tag = Protobuf::encodeVarint($number << 3 | ($packed ? 2 : $wire));
+        $out = '';
+        $n = 0;
+        foreach ($items as $item) {
+            if ($packed) {
+                $out .= Protobuf::encodeValue($type, $item);
+            } elseif ($type == Protobuf::TYPE_MESSAGE) {
+                $out .= $tag.Protobuf::encodeVarint($item->size());
+                $item->serializeWithCachedSizes($out);
+            } elseif ($type == Protobuf::TYPE_GROUP) {
+                $item->size();
+                $out .= $tag;
+                $item->serializeWithCachedSizes($out);
+                $out .= Protobuf::encodeVarint($number << 3 | 4);
+            } else {
+                $out .= $tag.Protobuf::encodeValue($type, $item);
+            }
+            $n++;
+            if (strlen($out) >= $chunkSize) {
+                fwrite($fp, $packed ? $tag.Protobuf::encodeVarint(strlen($out)).$out : $out);
+                $out = '';
+            }
         }
-
-        $i = 0;
-        $shift = 0;
-        for ($j = 0; $j < $len; $j++) {
-            $i |= ((ord($value[$j]) & 0x7F) << $shift);
-            $shift += 7;
+        if ($out !== '') {
+            fwrite($fp, $packed ? $tag.Protobuf::encodeVarint(strlen($out)).$out : $out);
         }
 
-        return $i;
+        return $n;
     }
 
-    public static function readDouble($fp)
+    /**
+     * The size computed by the last call to size().
+     */
+    public function getCachedSize()
     {
-        //throw Exception("I've not coded it yet Exception");
+        return $this->cachedSize;
     }
-    public static function readFloat($fp)
+
+    public function read($fp, &$limit = PHP_INT_MAX, $mask = null)
     {
-        //throw Exception("I've not coded it yet Exception");
+        // Read the whole message and decode it from memory.
+        if ($limit == PHP_INT_MAX) {
+            $buf = stream_get_contents($fp);
+        } else {
+            $buf = $limit > 0 ? fread($fp, $limit) : '';
+        }
+        if ($buf === false) {
+            throw new Exception('Error reading message');
+        }
+        $pos = 0;
+        $this->mergeFromString($buf, $pos, strlen($buf), $mask);
+        $limit -= $pos;
     }
-    public static function readUint64($fp)
+
+    public function mergeFromString($buf, &$pos, $end, $mask = null)
     {
-        //throw Exception("I've not coded it yet Exception");
+        $this->parseFields($buf, $pos, $end, $mask);
     }
-    public static function readInt64($fp)
+
+    public function writeWithCachedSizes($fp)
     {
-        //throw Exception("I've not coded it yet Exception");
+        $out = '';
+        $this->serializeFields($out);
+        fwrite($fp, $out);
     }
-    public static function readUint32($fp)
+
+    public function serializeWithCachedSizes(&$out)
     {
-        //throw Exception("I've not coded it yet Exception");
+        $this->serializeFields($out);
     }
-    public static function readInt32($fp)
+
+    public function size()
     {
-        //throw Exception("I've not coded it yet Exception");
+        return $this->sizeFields();
     }
-    public static function readZint32($fp)
+
+    public function validateRequired()
     {
-        //throw Exception("I've not coded it yet Exception");
+        foreach (static::$_fields as $field) {
+            if (($field[3] & Protobuf::REQUIRED) && $this->{$field[0]} === null
+                && !(($field[3] & Protobuf::LAZY) && $this->{$field[0].'Raw'} !== null)) {
+                return false;
+            }
+        }
+
+        return true;
     }
-    public static function readZint64($fp)
+
+    public function __toString()
     {
-        //throw Exception("I've not coded it yet Exception");
+        $ret = '';
+        if (!static::$_skipUnknown) {
+            $ret .= Protobuf::toString('unknown', $this->unknown);
+        }
+        foreach (static::$_fields as $field) {
+            list($name, $type, $wire, $flags, $class) = $field;
+            if ($flags & Protobuf::LAZY) {
+                $value = $this->{'get'.ucfirst($name)}();
+            } elseif ($type == Protobuf::TYPE_ENUM && !($flags & Protobuf::REPEATED) && method_exists($class, 'toString')) {
+                $value = $class::toString($this->$name);
+            } else {
+                $value = $this->$name;
+            }
+            $ret .= Protobuf::toString($name, $value);
+        }
+
+        return $ret;
     }
 
     /**
-     * Writes a varint to $fp.
-     * Returns the number of bytes written.
-     *
-     * @param $fp
-     * @param int $i The int to encode
-     *
-     * @throws Exception
-     *
-     * @return int The number of bytes written
+     * The generic decoder, a single loop dispatching on the field table.
      */
-    public static function writeVarint($fp, $i)
+    protected function parseFields($buf, &$pos, $end, $mask)
     {
-        $len = 0;
-        do {
-            $v = $i & 0x7F;
-            $i = $i >> 7;
-
-            if ($i != 0) {
-                $v |= 0x80;
+        $fields = static::$_fields;
+        while ($pos < $end) {
+            $tag = Protobuf::readVarintFromString($buf, $pos);
+            $wire = $tag & 0x07;
+            if ($wire == 4) {
+                break; // End of group
             }
-
-            if (fwrite($fp, chr($v)) !== 1) {
-                throw new Exception("writeVarint(): Error writing byte");
+            $number = $tag >> 3;
+            if (isset($fields[$number])) {
+                list($name, $type, $fieldWire, $flags, $class, $field) = $fields[$number];
+                if ($mask !== null && !isset($mask[$field])) {
+                    Protobuf::skipFieldFromString($buf, $pos, $wire);
+                    continue;
+                }
+                if ($wire == $fieldWire) {
+                    if ($type == Protobuf::TYPE_MESSAGE) {
+                        $len = Protobuf::readVarintFromString($buf, $pos);
+                        if ($flags & Protobuf::LAZY) {
+                            $this->{$name.'Raw'} = (string) substr($buf, $pos, $len);
+                            $this->$name = null;
+                            $pos += $len;
+                            continue;
+                        }
+                        $value = new $class();
+                        $value->parseFields($buf, $pos, $pos + $len, $mask === null || $mask[$field] === true ? null : $mask[$field]);
+                    } elseif ($type == Protobuf::TYPE_GROUP) {
+                        $value = new $class();
+                        $value->parseFields($buf, $pos, $end, $mask === null || $mask[$field] === true ? null : $mask[$field]);
+                    } else {
+                        $value = Protobuf::decodeValue($buf, $pos, $type);
+                    }
+                    if ($flags & Protobuf::REPEATED) {
+                        $this->{$name}[] = $value;
+                    } else {
+                        $this->$name = $value;
+                    }
+                    continue;
+                }
+                if ($wire == 2 && ($flags & Protobuf::REPEATED) && $fieldWire != 2 && $fieldWire != 3) {
+                    // Packed encoding of a repeated scalar
+                    $len = Protobuf::readVarintFromString($buf, $pos);
+                    $stop = $pos + $len;
+                    while ($pos < $stop) {
+                        $this->{$name}[] = Protobuf::decodeValue($buf, $pos, $type);
+                    }
+                    continue;
+                }
             }
-
-            $len++;
-        } while ($i != 0);
-
-        return $len;
+            if (static::$_skipUnknown) {
+                Protobuf::skipFieldFromString($buf, $pos, $wire);
+            } else {
+                $this->unknown[$number.'-'.Protobuf::getWiretype($wire)][] = Protobuf::readFieldFromString($buf, $pos, $wire);
+            }
+        }
+        if ($pos > $end) {
+            throw new Exception('Unexpected end of buffer');
+        }
+        if ($mask === null && !$this->validateRequired()) {
+            throw new Exception('Required fields are missing');
+        }
     }
 
-    public static function writeDouble($fp, $d)
-    {
-        //throw Exception("I've not coded it yet Exception");
-    }
-    public static function writeFloat($fp, $f)
-    {
-        //throw Exception("I've not coded it yet Exception");
-    }
-    public static function writeUint64($fp, $i)
-    {
-        //throw Exception("I've not coded it yet Exception");
-    }
-    public static function writeInt64($fp, $i)
+    /**
+     * The generic encoder, expects sizeFields() to have been called.
+     */
+    protected function serializeFields(&$out)
     {
-        //throw Exception("I've not coded it yet Exception");
+        if (!$this->validateRequired()) {
+            throw new Exception('Required fields are missing');
+        }
+        foreach (static::$_fields as $number => $field) {
+            list($name, $type, $wire, $flags) = $field;
+            if (($flags & Protobuf::LAZY) && $this->{$name.'Raw'} !== null) {
+                $raw = $this->{$name.'Raw'};
+                $out .= Protobuf::encodeVarint($number << 3 | 2).Protobuf::encodeVarint(strlen($raw)).$raw;
+                continue;
+            }
+            $values = $this->$name;
+            if ($values === null) {
+                continue;
+            }
+            if (!($flags & Protobuf::REPEATED)) {
+                $values = array($values);
+            } elseif ($flags & Protobuf::PACKED) {
+                if (!empty($values)) {
+                    $data = '';
+                    foreach ($values as $value) {
+                        $data .= Protobuf::encodeValue($type, $value);
+                    }
+                    $out .= Protobuf::encodeVarint($number << 3 | 2).Protobuf::encodeVarint(strlen($data)).$data;
+                }
+                continue;
+            }
+            $tag = Protobuf::encodeVarint($number << 3 | $wire);
+            foreach ($values as $value) {
+                $out .= $tag;
+                if ($type == Protobuf::TYPE_MESSAGE) {
+                    $out .= Protobuf::encodeVarint($value->cachedSize);
+                    $value->serializeFields($out);
+                } elseif ($type == Protobuf::TYPE_GROUP) {
+                    $value->serializeFields($out);
+                    $out .= Protobuf::encodeVarint($number << 3 | 4);
+                } else {
+                    $out .= Protobuf::encodeValue($type, $value);
+                }
+            }
+        }
     }
-    public static function writeUint32($fp, $i)
+
+    /**
+     * The generic sizer, caches the size of this message and its children.
+     */
+    protected function sizeFields()
     {
-        //throw Exception("I've not coded it yet Exception");
+        $size = 0;
+        foreach (static::$_fields as $number => $field) {
+            list($name, $type, $wire, $flags) = $field;
+            if (($flags & Protobuf::LAZY) && $this->{$name.'Raw'} !== null) {
+                $l = strlen($this->{$name.'Raw'});
+                $size += Protobuf::sizeVarint($number << 3) + Protobuf::sizeVarint($l) + $l;
+                continue;
+            }
+            $values = $this->$name;
+            if ($values === null) {
+                continue;
+            }
+            if (!($flags & Protobuf::REPEATED)) {
+                $values = array($values);
+            } elseif ($flags & Protobuf::PACKED) {
+                if (!empty($values)) {
+                    $l = 0;
+                    foreach ($values as $value) {
+                        $l += Protobuf::sizeValue($type, $value);
+                    }
+                    $size += Protobuf::sizeVarint($number << 3) + Protobuf::sizeVarint($l) + $l;
+                }
+                continue;
+            }
+            $tagSize = Protobuf::sizeVarint($number << 3);
+            foreach ($values as $value) {
+                if ($type == Protobuf::TYPE_MESSAGE) {
+                    $l = $value->sizeFields();
+                    $size += $tagSize + Protobuf::sizeVarint($l) + $l;
+                } elseif ($type == Protobuf::TYPE_GROUP) {
+                    $size += 2 * $tagSize + $value->sizeFields();
+                } else {
+                    $size += $tagSize + Protobuf::sizeValue($type, $value);
+                }
+            }
+        }
+
+        $this->cachedSize = $size;
+        return $size;
     }
-    public static function writeInt32($fp, $i)
+}
+
+/**
+ * Reads a stream in large chunks, so a sequence of messages can be decoded
+ * from memory without reading the stream byte by byte, nor all at once.
+ * The bytes between pos and the end of buf are yet to be decoded.
+ */
+class ProtobufChunkedReader
+{
+    public $buf = '';
+    public $pos = 0;
+
+    private $fp;
+    private $chunkSize;
+
+    public function __construct($fp, $chunkSize = 65536)
     {
-        //throw Exception("I've not coded it yet Exception");
+        $this->fp = $fp;
+        $this->chunkSize = $chunkSize;
     }
-    public static function writeZint32($fp, $i)
+
+    /**
+     * Makes sure at least $len bytes past pos are in buf, reading more of
+     * the stream if needed. Returns false if the stream ends before that.
+     */
+    public function fill($len)
     {
-        //throw Exception("I've not coded it yet Exception");
+        $available = strlen($this->buf) - $this->pos;
+        if ($available >= $len) {
+            return true;
+        }
+
+        // Drop what was decoded, so buf never outgrows a chunk and a message
+        $this->buf = (string) substr($this->buf, $this->pos);
+        $this->pos = 0;
+        while ($available < $len) {
+            $chunk = fread($this->fp, max($this->chunkSize, $len - $available));
+            if ($chunk === false) {
+                throw new Exception('Error reading the stream');
+            }
+            if ($chunk === '') {
+                if (feof($this->fp)) {
+                    return false;
+                }
+                continue;
+            }
+            $this->buf .= $chunk;
+            $available += strlen($chunk);
+        }
+
+        return true;
     }
-    public static function writeZint64($fp, $i)
+
+    /**
+     * Reads a varint, or returns false at the end of the stream.
+     */
+    public function readVarint()
     {
-        //throw Exception("I've not coded it yet Exception");
+        // A varint is at most 10 bytes long, the stream may end before that
+        if (!$this->fill(10) && !isset($this->buf[$this->pos])) {
+            return false;
+        }
+        return Protobuf::readVarintFromString($this->buf, $this->pos);
     }
 
     /**
-     * Seek past a varint.
+     * Skips $len bytes, reading past the buffered ones without keeping them.
      */
-    public static function skipVarint($fp)
+    public function skip($len)
     {
-        $len = 0;
-        do { // Keep reading until we find the last byte.
-            $b = fread($fp, 1);
-            if ($b === false) {
-                throw new Exception("skip(varint): Error reading byte");
-            }
-            $len++;
-        } while ($b >= "\x80");
+        $available = strlen($this->buf) - $this->pos;
+        if ($available >= $len) {
+            $this->pos += $len;
+            return;
+        }
 
-        return $len;
+        $len -= $available;
+        $this->buf = '';
+        $this->pos = 0;
+        while ($len > 0) {
+            $chunk = fread($this->fp, min($this->chunkSize, $len));
+            if ($chunk === false || ($chunk === '' && feof($this->fp))) {
+                throw new Exception('Unexpected end of stream');
+            }
+            $len -= strlen($chunk);
+        }
     }
 
     /**
-     * Seek past the current field.
+     * Skips the field of wire type $wireType whose tag was just read.
      */
-    public static function skipField($fp, $wireType)
+    public function skipField($wireType)
     {
         switch ($wireType) {
             case 0: // varint
-                return Protobuf::skipVarint($fp);
+                if ($this->readVarint() === false) {
+                    throw new Exception('Unexpected end of stream');
+                }
+                break;
 
             case 1: // 64bit
-                if (fseek($fp, 8, SEEK_CUR) === -1) {
-                    throw new Exception('skip('.ProtoBuf::getWiretype(1).'): Error seeking');
+                $this->skip(8);
+                break;
+
+            case 2: // length delimited
+                $len = $this->readVarint();
+                if ($len === false) {
+                    throw new Exception('Unexpected end of stream');
                 }
+                $this->skip($len);
+                break;
 
+            case 3: // Start group, skip up to the matching end group
+                while (($tag = $this->readVarint()) !== false && ($tag & 0x07) != 4) {
+                    $this->skipField($tag & 0x07);
+                }
+                if ($tag === false) {
+                    throw new Exception('Unexpected end of stream');
+                }
+                break;
+
+            case 5: // 32bit
+                $this->skip(4);
+                break;
+
+            default:
+                throw new Exception('skip('.Protobuf::getWiretype($wireType).'): Unsupported wire_type');
+        }
+    }
+}
+
+/**
+ * The primitives used to decode and encode the wire format. They are
+ * provided natively by the protobuf_primitives extension, found in ext/,
+ * when it is loaded, and by the userland code below otherwise.
+ */
+if (!class_exists('ProtobufPrimitives', false)) {
+    class ProtobufPrimitives
+    {
+        /**
+         * Returns how big (in bytes) this number would be as a varint.
+         */
+        public static function sizeVarint($i)
+        {
+            if ($i < 0) {
+                return 10;
+            }
+
+            /*$len = 0;
+            do {
+                $i = $i >> 7;
+                $len++;
+            } while ($i != 0);
+
+            return $len;*/
+
+            // TODO Change to a binary search.
+            if ($i < 0x80) {
+                return 1;
+            }
+            if ($i < 0x4000) {
+                return 2;
+            }
+            if ($i < 0x200000) {
+                return 3;
+            }
+            if ($i < 0x10000000) {
+                return 4;
+            }
+            if ($i < 0x800000000) {
+                return 5;
+            }
+            if ($i < 0x40000000000) {
+                return 6;
+            }
+            if ($i < 0x2000000000000) {
+                return 7;
+            }
+            if ($i < 0x100000000000000) {
                 return 8;
+            }
+            if ($i < 0x8000000000000000) {
+                return 9;
+            }
+        }
 
-            case 2: // length delimited
-                $varlen = 0;
-                $len = Protobuf::readVarint($fp, $varlen);
-                if (fseek($fp, $len, SEEK_CUR) === -1) {
-                    throw new Exception('skip('.ProtoBuf::getWiretype(2).'): Error seeking');
+        /**
+         * Tries to read a varint from $fp.
+         *
+         * @throws Exception
+         *
+         * @return int|bool Varint from the stream, or false if the stream has reached eof.
+         */
+        public static function readVarint($fp, &$limit = null)
+        {
+            $i = 0;
+            $shift = 0;
+            $len = 0;
+            do { // Keep reading until we find the last byte.
+                $b = fread($fp, 1);
+                if ($b === false) {
+                    throw new Exception("readVarint(): Error reading byte");
+                }
+                if (!isset($b[0])) {
+                    if ($len == 0 && feof($fp)) {
+                        return false;
+                    }
+                    throw new Exception("readVarint(): Error reading byte");
                 }
 
-                return $len - $varlen;
+                $b = ord($b);
+                $i |= ($b & 0x7F) << $shift;
+                $shift += 7;
+                $len++;
+            } while ($b >= 0x80);
 
-            //case 3: // Start group TODO we must keep looping until we find the closing end grou
+            if ($limit !== null) {
+                $limit -= $len;
+            }
 
-            //case 4: // End group - We should never skip a end group!
-            //    return 0; // Do nothing
+            return $i;
+        }
 
-            case 5: // 32bit
-                if (fseek($fp, 4, SEEK_CUR) === -1) {
-                    throw new Exception('skip('.ProtoBuf::getWiretype(5).'): Error seeking');
+        /**
+         * Reads a varint from $buf starting at $pos, and advances $pos past it.
+         *
+         * @throws Exception
+         *
+         * @return int Varint from the buffer.
+         */
+        public static function readVarintFromString($buf, &$pos)
+        {
+            // Most varints are a single byte
+            if (isset($buf[$pos]) && ($b = ord($buf[$pos])) < 0x80) {
+                $pos++;
+                return $b;
+            }
+
+            $i = 0;
+            $shift = 0;
+            do { // Keep reading until we find the last byte.
+                if (!isset($buf[$pos])) {
+                    throw new Exception("readVarintFromString(): Unexpected end of buffer");
                 }
+                $b = ord($buf[$pos++]);
+                $i |= ($b & 0x7F) << $shift;
+                $shift += 7;
+            } while ($b >= 0x80);
 
-                return 4;
+            return $i;
+        }
 
-            default:
-                throw new Exception('skip('.ProtoBuf::getWiretype($wireType).'): Unsupported wire_type');
+        /**
+         * Reads $len bytes from $fp and unpacks them with $format.
+         *
+         * @return mixed The unpacked value, or false at the end of the stream
+         */
+        private static function readFixed($fp, $len, $format)
+        {
+            $b = fread($fp, $len);
+            if ($b === false || strlen($b) < $len) {
+                return false;
+            }
+
+            return unpack($format, $b)[1];
         }
-    }
 
-    /**
-     * Read a unknown field from the stream and return its raw bytes.
-     */
-    public static function readField($fp, $wireType, &$limit = null)
-    {
-        switch ($wireType) {
-            case 0: // varint
-                return Protobuf::readVarint($fp, $limit);
+        public static function readDouble($fp)
+        {
+            return self::readFixed($fp, 8, 'e');
+        }
+        public static function readFloat($fp)
+        {
+            return self::readFixed($fp, 4, 'g');
+        }
+        public static function readUint64($fp)
+        {
+            return self::readFixed($fp, 8, 'P');
+        }
+        public static function readInt64($fp)
+        {
+            return self::readFixed($fp, 8, 'P');
+        }
+        public static function readUint32($fp)
+        {
+            return self::readFixed($fp, 4, 'V');
+        }
+        public static function readInt32($fp)
+        {
+            $i = self::readFixed($fp, 4, 'V');
+            if ($i === false) {
+                return false;
+            }
 
-            case 1: // 64bit
-                $limit -= 8;
+            return ($i ^ 0x80000000) - 0x80000000;
+        }
+        public static function readZint32($fp, &$limit = null)
+        {
+            return self::readZint64($fp, $limit);
+        }
+        public static function readZint64($fp, &$limit = null)
+        {
+            $i = self::readVarint($fp, $limit);
+            if ($i === false) {
+                return false;
+            }
 
-                return fread($fp, 8);
+            return (($i >> 1) & PHP_INT_MAX) ^ -($i & 1);
+        }
 
-            case 2: // length delimited
-                $len = Protobuf::readVarint($fp, $limit);
-                $limit -= $len;
+        /**
+         * Writes a varint to $fp.
+         * Returns the number of bytes written.
+         *
+         * @param $fp
+         * @param int $i The int to encode
+         *
+         * @throws Exception
+         *
+         * @return int The number of bytes written
+         */
+        public static function writeVarint($fp, $i)
+        {
+            $value = self::encodeVarint($i);
+            $len = strlen($value);
+            if (fwrite($fp, $value) !== $len) {
+                throw new Exception("writeVarint(): Error writing byte");
+            }
 
-                return fread($fp, $len);
+            return $len;
+        }
 
-            //case 3: // Start group TODO we must keep looping until we find the closing end grou
+        /**
+         * Encodes a varint into a string.
+         * Negative numbers are encoded as their 64 bit two's complement, in 10 bytes.
+         *
+         * @param int $i The int to encode
+         *
+         * @return string The encoded varint
+         */
+        public static function encodeVarint($i)
+        {
+            $value = '';
+            while ($i < 0 || $i > 0x7F) {
+                $value .= chr(($i & 0x7F) | 0x80);
+                $i = ($i >> 7) & 0x01FFFFFFFFFFFFFF; // Logical shift right
+            }
 
-            //case 4: // End group - We should never skip a end group!
-            //    return 0; // Do nothing
+            return $value.chr($i);
+        }
 
-            case 5: // 32bit
-                $limit -= 4;
+        /**
+         * Writes $value, packed by pack(), to $fp.
+         *
+         * @return int The number of bytes written
+         */
+        private static function writeFixed($fp, $value)
+        {
+            $len = strlen($value);
+            if (fwrite($fp, $value) !== $len) {
+                throw new Exception("writeFixed(): Error writing bytes");
+            }
+
+            return $len;
+        }
+
+        public static function writeDouble($fp, $d)
+        {
+            return self::writeFixed($fp, pack('e', $d));
+        }
+        public static function writeFloat($fp, $f)
+        {
+            return self::writeFixed($fp, pack('g', $f));
+        }
+        public static function writeUint64($fp, $i)
+        {
+            return self::writeFixed($fp, pack('P', $i));
+        }
+        public static function writeInt64($fp, $i)
+        {
+            return self::writeFixed($fp, pack('P', $i));
+        }
+        public static function writeUint32($fp, $i)
+        {
+            return self::writeFixed($fp, pack('V', $i));
+        }
+        public static function writeInt32($fp, $i)
+        {
+            return self::writeFixed($fp, pack('V', $i));
+        }
+        public static function writeZint32($fp, $i)
+        {
+            return self::writeVarint($fp, ($i << 1) ^ ($i >> 31));
+        }
+        public static function writeZint64($fp, $i)
+        {
+            return self::writeVarint($fp, ($i << 1) ^ ($i >> 63));
+        }
+
+        /**
+         * Seek past a varint.
+         */
+        public static function skipVarint($fp)
+        {
+            $len = 0;
+            do { // Keep reading until we find the last byte.
+                $b = fread($fp, 1);
+                if ($b === false) {
+                    throw new Exception("skip(varint): Error reading byte");
+                }
+                if (!isset($b[0])) {
+                    if ($len == 0) {
+                        break;
+                    }
+                    throw new Exception("readVarint(): Error reading byte");
+                }
+                $len++;
+            } while ($b >= "\x80");
+
+            return $len;
+        }
+
+        /**
+         * Seek past the current field.
+         */
+        public static function skipField($fp, $wireType)
+        {
+            switch ($wireType) {
+                case 0: // varint
+                    return self::skipVarint($fp);
+
+                case 1: // 64bit
+                    if (fseek($fp, 8, SEEK_CUR) === -1) {
+                        throw new Exception('skip('.Protobuf::getWiretype(1).'): Error seeking');
+                    }
+
+                    return 8;
+
+                case 2: // length delimited
+                    $varlen = 0;
+                    $len = self::readVarint($fp, $varlen);
+                    if (fseek($fp, $len, SEEK_CUR) === -1) {
+                        throw new Exception('skip('.Protobuf::getWiretype(2).'): Error seeking');
+                    }
+
+                    return $len - $varlen;
+
+                case 3: // Start group, skip up to the matching end group
+                    $len = 0;
+                    do {
+                        $varlen = 0;
+                        $tag = self::readVarint($fp, $varlen);
+                        if ($tag === false) {
+                            throw new Exception('skip('.Protobuf::getWiretype(3).'): Unexpected end of stream');
+                        }
+                        $len -= $varlen;
+                        if (($tag & 0x07) == 4) {
+                            return $len;
+                        }
+                        $len += self::skipField($fp, $tag & 0x07);
+                    } while (true);
+
+                //case 4: // End group - We should never skip a end group!
+                //    return 0; // Do nothing
+
+                case 5: // 32bit
+                    if (fseek($fp, 4, SEEK_CUR) === -1) {
+                        throw new Exception('skip('.Protobuf::getWiretype(5).'): Error seeking');
+                    }
+
+                    return 4;
+
+                default:
+                    throw new Exception('skip('.Protobuf::getWiretype($wireType).'): Unsupported wire_type');
+            }
+        }
+
+        /**
+         * Advance $pos past the current field in $buf.
+         */
+        public static function skipFieldFromString($buf, &$pos, $wireType)
+        {
+            switch ($wireType) {
+                case 0: // varint
+                    self::readVarintFromString($buf, $pos);
+                    break;
+
+                case 1: // 64bit
+                    $pos += 8;
+                    break;
+
+                case 2: // length delimited
+                    $len = self::readVarintFromString($buf, $pos);
+                    // Lengths of 2^63 and more are negative
+                    if ($len < 0 || $len > strlen($buf) - $pos) {
+                        throw new Exception('Unexpected end of buffer');
+                    }
+                    $pos += $len;
+                    break;
+
+                case 3: // Start group, skip up to the matching end group
+                    while ((($tag = self::readVarintFromString($buf, $pos)) & 0x07) != 4) {
+                        self::skipFieldFromString($buf, $pos, $tag & 0x07);
+                    }
+                    break;
+
+                case 5: // 32bit
+                    $pos += 4;
+                    break;
+
+                default:
+                    throw new Exception('skip('.Protobuf::getWiretype($wireType).'): Unsupported wire_type');
+            }
+        }
+
+        /**
+         * Read a unknown field from the stream and return its raw bytes.
+         */
+        public static function readField($fp, $wireType, &$limit = null)
+        {
+            switch ($wireType) {
+                case 0: // varint
+                    return self::readVarint($fp, $limit);
+
+                case 1: // 64bit
+                    $limit -= 8;
 
-                return fread($fp, 4);
+                    return fread($fp, 8);
 
+                case 2: // length delimited
+                    $len = self::readVarint($fp, $limit);
+                    $limit -= $len;
+
+                    return fread($fp, $len);
+
+                //case 3: // Start group TODO we must keep looping until we find the closing end grou
+
+                //case 4: // End group - We should never skip a end group!
+                //    return 0; // Do nothing
+
+                case 5: // 32bit
+                    $limit -= 4;
+
+                    return fread($fp, 4);
+
+                default:
+                    throw new Exception('read_unknown('.Protobuf::getWiretype($wireType).'): Unsupported wire_type');
+            }
+        }
+
+        /**
+         * Read a unknown field from $buf and return its raw bytes.
+         */
+        public static function readFieldFromString($buf, &$pos, $wireType)
+        {
+            switch ($wireType) {
+                case 0: // varint
+                    return self::readVarintFromString($buf, $pos);
+
+                case 1: // 64bit
+                    $value = (string) substr($buf, $pos, 8);
+                    $pos += 8;
+
+                    return $value;
+
+                case 2: // length delimited
+                    $len = self::readVarintFromString($buf, $pos);
+                    if ($len < 0 || $len > strlen($buf) - $pos) {
+                        throw new Exception('Unexpected end of buffer');
+                    }
+                    $value = (string) substr($buf, $pos, $len);
+                    $pos += $len;
+
+                    return $value;
+
+                case 5: // 32bit
+                    $value = (string) substr($buf, $pos, 4);
+                    $pos += 4;
+
+                    return $value;
+
+                default:
+                    throw new Exception('read_unknown('.Protobuf::getWiretype($wireType).'): Unsupported wire_type');
+            }
+        }
+    }
+}
+
+/**
+ * Class to aid in the parsing and creating of Protocol Buffer Messages.
+ * This class should be included by the developer before they use a
+ * generated protobuf class.
+ *
+ * @author Andrew Brampton
+ */
+class Protobuf extends ProtobufPrimitives
+{
+    const TYPE_DOUBLE   = 1;  // double, exactly eight bytes on the wire.
+    const TYPE_FLOAT    = 2;  // float, exactly four bytes on the wire.
+    const TYPE_INT64    = 3;  // int64, varint on the wire.  Negative numbers
+                              // take 10 bytes.  Use TYPE_SINT64 if negative
+                              // values are likely.
+    const TYPE_UINT64   = 4;  // uint64, varint on the wire.
+    const TYPE_INT32    = 5;  // int32, varint on the wire.  Negative numbers
+                              // take 10 bytes.  Use TYPE_SINT32 if negative
+                              // values are likely.
+    const TYPE_FIXED64  = 6;  // uint64, exactly eight bytes on the wire.
+    const TYPE_FIXED32  = 7;  // uint32, exactly four bytes on the wire.
+    const TYPE_BOOL     = 8;  // bool, varint on the wire.
+    const TYPE_STRING   = 9;  // UTF-8 text.
+    const TYPE_GROUP    = 10; // Tag-delimited message.  Deprecated.
+    const TYPE_MESSAGE  = 11; // Length-delimited message.
+
+    const TYPE_BYTES    = 12; // Arbitrary byte array.
+    const TYPE_UINT32   = 13; // uint32, varint on the wire
+    const TYPE_ENUM     = 14; // Enum, varint on the wire
+    const TYPE_SFIXED32 = 15; // int32, exactly four bytes on the wire
+    const TYPE_SFIXED64 = 16; // int64, exactly eight bytes on the wire
+    const TYPE_SINT32   = 17; // int32, ZigZag-encoded varint on the wire
+    const TYPE_SINT64   = 18; // int64, ZigZag-encoded varint on the wire
+
+    // Flags of the fields in the tables of the generated messages
+    const REPEATED = 1;
+    const PACKED   = 2;
+    const REQUIRED = 4;
+    const LAZY     = 8; // Raw bytes kept in the $<name>Raw property
+
+    /**
+     * Returns a string representing this wiretype.
+     */
+    public static function getWiretype($wireType)
+    {
+        switch ($wireType) {
+            case 0:
+                return 'varint';
+            case 1:
+                return '64-bit';
+            case 2:
+                return 'length-delimited';
+            case 3:
+                return 'group start';
+            case 4:
+                return 'group end';
+            case 5:
+                return '32-bit';
+            default:
+                return 'unknown';
+        }
+    }
+
+    /**
+     * Decodes one value of the given field type from $buf, used by the
+     * generic codec in ProtobufMessage. Messages and groups are decoded
+     * by the codec itself.
+     *
+     * @param string $buf   The buffer to decode from
+     * @param int    $pos   The position to decode at, advanced past the value
+     * @param int    $type  One of the TYPE_* constants
+     *
+     * @return mixed The decoded value
+     */
+    public static function decodeValue($buf, &$pos, $type)
+    {
+        switch ($type) {
+            case self::TYPE_DOUBLE:
+                $value = unpack('e', $buf, $pos)[1];
+                $pos += 8;
+                return $value;
+            case self::TYPE_FLOAT:
+                $value = unpack('g', $buf, $pos)[1];
+                $pos += 4;
+                return $value;
+            case self::TYPE_FIXED64:
+            case self::TYPE_SFIXED64:
+                $value = unpack('P', $buf, $pos)[1];
+                $pos += 8;
+                return $value;
+            case self::TYPE_FIXED32:
+                $value = unpack('V', $buf, $pos)[1];
+                $pos += 4;
+                return $value;
+            case self::TYPE_SFIXED32:
+                $value = unpack('V', $buf, $pos)[1];
+                $pos += 4;
+                return ($value ^ 0x80000000) - 0x80000000;
+            case self::TYPE_BOOL:
+                return self::readVarintFromString($buf, $pos) > 0;
+            case self::TYPE_STRING:
+            case self::TYPE_BYTES:
+                $len = self::readVarintFromString($buf, $pos);
+                $value = (string) substr($buf, $pos, $len);
+                $pos += $len;
+                return $value;
+            case self::TYPE_SINT32:
+            case self::TYPE_SINT64:
+                $value = self::readVarintFromString($buf, $pos);
+                return (($value >> 1) & PHP_INT_MAX) ^ -($value & 1);
+            default:
+                return self::readVarintFromString($buf, $pos);
+        }
+    }
+
+    /**
+     * Encodes one value of the given field type, which must not be a
+     * message or a group.
+     */
+    public static function encodeValue($type, $value)
+    {
+        switch ($type) {
+            case self::TYPE_DOUBLE:
+                return pack('e', $value);
+            case self::TYPE_FLOAT:
+                return pack('g', $value);
+            case self::TYPE_FIXED64:
+            case self::TYPE_SFIXED64:
+                return pack('P', $value);
+            case self::TYPE_FIXED32:
+            case self::TYPE_SFIXED32:
+                return pack('V', $value);
+            case self::TYPE_BOOL:
+                return $value ? "\x01" : "\x00";
+            case self::TYPE_STRING:
+            case self::TYPE_BYTES:
+                return self::encodeVarint(strlen($value)).$value;
+            case self::TYPE_SINT32:
+                return self::encodeVarint(($value << 1) ^ ($value >> 31));
+            case self::TYPE_SINT64:
+                return self::encodeVarint(($value << 1) ^ ($value >> 63));
             default:
-                throw new Exception('read_unknown('.ProtoBuf::getWiretype($wireType).'): Unsupported wire_type');
+                return self::encodeVarint($value);
         }
     }
 
+    /**
+     * Returns the size of encodeValue($type, $value).
+     */
+    public static function sizeValue($type, $value)
+    {
+        switch ($type) {
+            case self::TYPE_DOUBLE:
+            case self::TYPE_FIXED64:
+            case self::TYPE_SFIXED64:
+                return 8;
+            case self::TYPE_FLOAT:
+            case self::TYPE_FIXED32:
+            case self::TYPE_SFIXED32:
+                return 4;
+            case self::TYPE_BOOL:
+                return 1;
+            case self::TYPE_STRING:
+            case self::TYPE_BYTES:
+                $l = strlen($value);
+                return self::sizeVarint($l) + $l;
+            case self::TYPE_SINT32:
+                return self::sizeVarint(($value << 1) ^ ($value >> 31));
+            case self::TYPE_SINT64:
+                return self::sizeVarint(($value << 1) ^ ($value >> 63));
+            default:
+                return self::sizeVarint($value);
+        }
+    }
+
+    /**
+     * Turns a list of field paths, such as array('name', 'phone.number'),
+     * into the tree of field names checked by the generated read methods.
+     * Paths use the field names of the .proto, e.g. 'phone_number'.
+     * A field mapped to true is decoded with all of its sub-fields.
+     */
+    public static function compileMask(array $paths)
+    {
+        $mask = array();
+        foreach ($paths as $path) {
+            $node = &$mask;
+            $names = explode('.', $path);
+            $last = count($names) - 1;
+            foreach ($names as $i => $name) {
+                if (isset($node[$name]) && $node[$name] === true) {
+                    break; // A parent is already decoded in full
+                }
+                if ($i == $last) {
+                    $node[$name] = true;
+                } else {
+                    if (!isset($node[$name])) {
+                        $node[$name] = array();
+                    }
+                    $node = &$node[$name];
+                }
+            }
+            unset($node);
+        }
+
+        return $mask;
+    }
+
     /**
      * Used to aid in pretty printing of Protobuf objects
      */
@@ -0,0 +1,447 @@
+<?php
+/**
+ * Round trip tests of the generated code and of the generic codec, against
+ * addressbook.proto, bench/shapes.proto and tests/test.proto.
+ *
+ *   php tests/codec.php [--gen=DIR] [--extension]
+ *
+ * --gen is the directory the protos were generated into (see `make test`).
+ * With --extension the run fails unless the protobuf_primitives extension is
+ * loaded, so the tests are known to have gone through the native primitives.
+ */
+
+$options = getopt('', array('gen:', 'extension'));
+$gen = isset($options['gen']) ? $options['gen'] : __DIR__ . '/gen';
+
+require __DIR__ . '/../protocolbuffers.inc.php';
+require $gen . '/addressbook.proto.php';
+require $gen . '/bench/shapes.proto.php';
+require $gen . '/tests/test.proto.php';
+
+$failures = 0;
+$current = '';
+
+function check($ok, $what)
+{
+    global $failures, $current;
+    if (!$ok) {
+        echo "FAIL $current: $what\n";
+        $failures++;
+    }
+}
+
+function checkSame($expected, $actual, $what)
+{
+    check($expected === $actual, $what . ', expected ' . var_export($expected, true) . ' got ' . var_export($actual, true));
+}
+
+/**
+ * Runs $fn, counting an exception as a failure.
+ */
+function test($name, $fn)
+{
+    global $failures, $current;
+    $current = $name;
+    try {
+        $fn();
+    } catch (Exception $e) {
+        echo "FAIL $name: " . get_class($e) . ': ' . $e->getMessage() . "\n";
+        $failures++;
+    }
+}
+
+/**
+ * Returns a stream positioned at the start of $bytes.
+ */
+function stream($bytes)
+{
+    $fp = fopen('php://memory', 'r+b');
+    fwrite($fp, $bytes);
+    rewind($fp);
+    return $fp;
+}
+
+/**
+ * Returns $m encoded by serializeToString(), checking that write() and the
+ * generic serialize() produce the same bytes.
+ */
+function encode($m, $what)
+{
+    $bytes = $m->serializeToString();
+    $fp = fopen('php://memory', 'r+b');
+    $m->write($fp);
+    rewind($fp);
+    checkSame($bytes, stream_get_contents($fp), "$what: write() and serializeToString() agree");
+    checkSame($bytes, $m->serialize(), "$what: serialize() and serializeToString() agree");
+    return $bytes;
+}
+
+/**
+ * Decodes $bytes as a $class with every decoder: the generated one, from a
+ * string and from a stream, and the generic codec.
+ */
+function decode($class, $bytes, array $mask = null)
+{
+    $limit = PHP_INT_MAX;
+    $streamLimit = PHP_INT_MAX;
+    return array(
+        'mergeFromString' => new $class($bytes, $limit, $mask),
+        'read' => new $class(stream($bytes), $streamLimit, $mask),
+        'generic' => $class::parse($bytes, $mask),
+    );
+}
+
+function person($id, $name, array $numbers = array())
+{
+    $person = new Person();
+    $person->setId($id);
+    $person->setName($name);
+    foreach ($numbers as $number) {
+        $phone = new PhoneNumber();
+        $phone->setNumber($number);
+        $phone->setType(PhoneType::MOBILE);
+        $person->addPhone($phone);
+    }
+    return $person;
+}
+
+if (isset($options['extension']) && !extension_loaded('protobuf_primitives')) {
+    echo "FAIL: the protobuf_primitives extension is not loaded\n";
+    exit(1);
+}
+
+test('masks are keyed by the proto field names on every decode path', function () {
+    $address = new Test\Address();
+    $address->setStreetName('Main Street');
+    $address->setHouseNumber(7);
+    $record = new Test\Record();
+    $record->setPhoneNumber('555 0100');
+    $record->setHomeAddress($address);
+    $record->setLastSeen(-5);
+    $bytes = $record->serializeToString();
+
+    $decoders = array(
+        'mergeFromString' => function ($mask) use ($bytes) {
+            return Test\Record::parseWithMask($bytes, $mask);
+        },
+        'read' => function ($mask) use ($bytes) {
+            return Test\Record::parseWithMask(stream($bytes), $mask);
+        },
+        'generic' => function ($mask) use ($bytes) {
+            return Test\Record::parse($bytes, $mask);
+        },
+    );
+    foreach ($decoders as $path => $decode) {
+        $m = $decode(array('phone_number', 'home_address.street_name'));
+        checkSame('555 0100', $m->getPhoneNumber(), "$path decodes phone_number");
+        checkSame('Main Street', $m->getHomeAddress()->getStreetName(), "$path decodes home_address.street_name");
+        check(!$m->getHomeAddress()->hasHouseNumber(), "$path skips home_address.house_number");
+        check(!$m->hasLastSeen(), "$path skips last_seen");
+
+        $m = $decode(array('phoneNumber', 'homeAddress'));
+        check(!$m->hasPhoneNumber(), "$path does not match phoneNumber");
+        check(!$m->hasHomeAddress(), "$path does not match homeAddress");
+    }
+});
+
+test('lengths past the end of the buffer throw', function () {
+    $huge = "\x80\x80\x80\x80\x80\x80\x80\x80\x80\x01"; // 2^63
+    $inputs = array(
+        'unknown field, 2^63 long' => array("\x7a" . $huge, null),
+        'unknown field, 1 byte short' => array("\x7a\x04abc", null),
+        'skipped field, 2^63 long' => array("\x0a" . $huge, array('last_seen')),
+        'skipped field, 1 byte short' => array("\x0a\x04abc", array('last_seen')),
+    );
+    foreach ($inputs as $what => $input) {
+        list($bytes, $mask) = $input;
+        foreach (array('generated', 'generic') as $path) {
+            $threw = false;
+            try {
+                if ($path == 'generated') {
+                    $limit = PHP_INT_MAX;
+                    new Test\Record($bytes, $limit, $mask);
+                } else {
+                    Test\Record::parse($bytes, $mask);
+                }
+            } catch (Exception $e) {
+                $threw = true;
+            }
+            check($threw, "$path decoder accepted $what");
+        }
+    }
+});
+
+test('every scalar type round trips', function () {
+    $values = array(
+        'Dbl' => -3.141592653589793,
+        'Flt' => 0.5,
+        'I64' => PHP_INT_MIN,
+        'U64' => PHP_INT_MAX,
+        'I32' => -5,
+        'Fx64' => PHP_INT_MAX,
+        'Fx32' => 4000000000,
+        'Flag' => true,
+        'U32' => 4000000000,
+        'Sfx32' => -2000000000,
+        'Sfx64' => -1234567890123456,
+        'S32' => -2147483648,
+        'S64' => PHP_INT_MIN,
+        'Color' => Bench\Color::BLUE,
+        'Small' => 1,
+        'Tag' => "tag\0\xff",
+    );
+    $m = new Bench\Scalars();
+    foreach ($values as $name => $value) {
+        $m->{'set' . $name}($value);
+    }
+    $bytes = encode($m, 'Scalars');
+
+    foreach (decode('Bench\Scalars', $bytes) as $path => $decoded) {
+        foreach ($values as $name => $value) {
+            checkSame($value, $decoded->{'get' . $name}(), "$path decodes $name");
+        }
+        checkSame($bytes, encode($decoded, "Scalars decoded by $path"), "$path round trips");
+    }
+
+    // Encodings given by the protobuf documentation
+    $encodings = array(
+        'S32' => array(-1, "\x60\x01"),
+        'S64' => array(-2, "\x68\x03"),
+        'I32' => array(-1, "\x28\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01"),
+        'Sfx32' => array(-2, "\x55\xfe\xff\xff\xff"),
+        'U32' => array(300, "\x48\xac\x02"),
+    );
+    foreach ($encodings as $name => $encoding) {
+        list($value, $expected) = $encoding;
+        $m = new Bench\Scalars();
+        $m->{'set' . $name}($value);
+        checkSame(bin2hex($expected), bin2hex(encode($m, $name)), "$name $value is encoded");
+        foreach (decode('Bench\Scalars', $expected) as $path => $decoded) {
+            checkSame($value, $decoded->{'get' . $name}(), "$path decodes $name $value");
+        }
+    }
+});
+
+test('packed and unpacked input decode into either kind of field', function () {
+    $values = array(
+        'Doubles' => array(1.5, -2.25, 0.0),
+        'Floats' => array(0.5, -4.0),
+        'Int64S' => array(-1, PHP_INT_MAX, PHP_INT_MIN),
+        'Uint64S' => array(0, PHP_INT_MAX),
+        'Int32S' => array(-5, 300, 2147483647),
+        'Fixed64S' => array(1, PHP_INT_MAX),
+        'Fixed32S' => array(0, 4000000000),
+        'Bools' => array(true, false, true),
+        'Uint32S' => array(4000000000, 1),
+        'Sfixed32S' => array(-2000000000, 7),
+        'Sfixed64S' => array(PHP_INT_MIN, 9),
+        'Sint32S' => array(-2147483648, 2147483647, -1),
+        'Sint64S' => array(PHP_INT_MIN, PHP_INT_MAX, -1),
+        'Colors' => array(Test\Color::BLUE, Test\Color::RED, Test\Color::GREEN),
+    );
+    $encoded = array();
+    foreach (array('Test\Unpacked', 'Test\Packed') as $class) {
+        $m = new $class();
+        foreach ($values as $name => $value) {
+            $m->{'addAll' . $name}($value);
+        }
+        $encoded[$class] = encode($m, $class);
+    }
+    checkSame("\x09", substr($encoded['Test\Unpacked'], 0, 1), 'unpacked doubles are written one by one');
+    checkSame("\x0a\x18", substr($encoded['Test\Packed'], 0, 2), 'packed doubles are written as one run');
+
+    foreach ($encoded as $from => $bytes) {
+        foreach (array('Test\Unpacked', 'Test\Packed') as $to) {
+            foreach (decode($to, $bytes) as $path => $decoded) {
+                foreach ($values as $name => $value) {
+                    checkSame($value, $decoded->{'get' . $name . 'Array'}(), "$path decodes $name from $from into $to");
+                }
+                checkSame($encoded[$to], encode($decoded, "$to decoded by $path"), "$path re-encodes $from as $to");
+            }
+        }
+    }
+});
+
+test('groups round trip', function () {
+    $m = new Test\Record();
+    foreach (array(1 => 'first', 2 => 'second') as $id => $name) {
+        $entry = new Test\Entry();
+        $entry->setEntryId($id);
+        $entry->setEntryName($name);
+        $m->addEntry($entry);
+    }
+    $bytes = encode($m, 'Record');
+    checkSame("\x23\x28\x01\x32\x05first\x24", substr($bytes, 0, 11), 'a group is written between start and end tags');
+
+    foreach (decode('Test\Record', $bytes) as $path => $decoded) {
+        checkSame(2, $decoded->getEntryCount(), "$path decodes every entry");
+        checkSame(2, $decoded->getEntry(1)->getEntryId(), "$path decodes entry_id");
+        checkSame('second', $decoded->getEntry(1)->getEntryName(), "$path decodes entry_name");
+        checkSame($bytes, encode($decoded, "Record decoded by $path"), "$path round trips");
+    }
+});
+
+test('lazy fields are written back unchanged and decoded on access', function () {
+    // house_number before street_name, which an encoder never writes
+    $raw = "\x10\x07\x0a\x04Main";
+    $bytes = "\x0a\x01x\x1a" . chr(strlen($raw)) . $raw;
+
+    foreach (decode('Test\Record', $bytes) as $path => $decoded) {
+        check($decoded->hasWorkAddress(), "$path keeps work_address");
+        checkSame($bytes, encode($decoded, "Record decoded by $path"), "$path writes work_address back unchanged");
+        checkSame('Main', $decoded->getWorkAddress()->getStreetName(), "$path decodes work_address.street_name on access");
+        checkSame(7, $decoded->getWorkAddress()->getHouseNumber(), "$path decodes work_address.house_number on access");
+        checkSame("\x0a\x01x\x1a\x08\x0a\x04Main\x10\x07", encode($decoded, "Record accessed by $path"), "$path encodes work_address once decoded");
+    }
+});
+
+test('masked decode skips the fields outside the mask', function () {
+    $book = new AddressBook();
+    $book->addPerson(person(1, 'Alice', array('555 0100', '555 0101')));
+    $book->addPerson(person(2, 'Bob'));
+    $bytes = encode($book, 'AddressBook');
+
+    foreach (decode('AddressBook', $bytes, array('person.name', 'person.phone.number')) as $path => $decoded) {
+        checkSame(2, $decoded->getPersonCount(), "$path decodes every person");
+        checkSame('Bob', $decoded->getPerson(1)->getName(), "$path decodes person.name");
+        check(!$decoded->getPerson(0)->hasId(), "$path skips person.id");
+        checkSame('555 0101', $decoded->getPerson(0)->getPhone(1)->getNumber(), "$path decodes person.phone.number");
+        check(!$decoded->getPerson(0)->getPhone(0)->hasType(), "$path skips person.phone.type");
+    }
+});
+
+test('delimited messages round trip', function () {
+    $people = array(person(1, 'Alice', array('555 0100')), person(2, 'Bob'), person(3, str_repeat('C', 300)));
+    $fp = fopen('php://memory', 'r+b');
+    $people[0]->writeDelimitedTo($fp);
+    checkSame(2, Person::writeDelimitedMany($fp, array_slice($people, 1), 16), 'writeDelimitedMany() counts the messages');
+
+    rewind($fp);
+    $read = array();
+    while (($m = Person::parseDelimitedFrom($fp)) !== null) {
+        $read[] = $m;
+    }
+    checkSame(count($people), count($read), 'parseDelimitedFrom() reads every message');
+    foreach ($people as $i => $person) {
+        checkSame($person->serializeToString(), $read[$i]->serializeToString(), "parseDelimitedFrom() reads message $i");
+    }
+
+    rewind($fp);
+    $read = array();
+    foreach (Person::parseDelimitedStream($fp, 7) as $m) {
+        $read[] = $m;
+    }
+    checkSame(count($people), count($read), 'parseDelimitedStream() yields every message');
+    foreach ($people as $i => $person) {
+        checkSame($person->serializeToString(), $read[$i]->serializeToString(), "parseDelimitedStream() yields message $i");
+    }
+
+    rewind($fp);
+    foreach (Person::parseDelimitedStream($fp, 7, array('id')) as $i => $m) {
+        checkSame($i + 1, $m->getId(), "parseDelimitedStream() decodes the masked id of message $i");
+        check(!$m->hasName(), "parseDelimitedStream() skips the name of message $i");
+    }
+});
+
+test('iterate yields the elements of a repeated field', function () {
+    $wide = new Bench\Wide();
+    $wide->addAllInts(array(1, -2, 3));
+    $wide->addAllNames(array('skipped', 'too'));
+    for ($i = 0; $i < 20; $i++) {
+        $item = new Bench\Item();
+        $item->setId($i);
+        $item->setName(str_repeat('n', $i));
+        $wide->addItems($item);
+    }
+    $wide->addAllIds(array(7, 8));
+    $bytes = encode($wide, 'Wide');
+
+    $sources = array(
+        'a string' => function () use ($bytes) {
+            return Bench\Wide::iterateItems($bytes);
+        },
+        'a stream' => function () use ($bytes) {
+            return Bench\Wide::iterateItems(stream($bytes), 5);
+        },
+    );
+    foreach ($sources as $what => $iterate) {
+        $n = 0;
+        foreach ($iterate() as $item) {
+            checkSame($wide->getItems($n)->serializeToString(), $item->serializeToString(), "iterateItems() from $what yields item $n");
+            $n++;
+        }
+        checkSame(20, $n, "iterateItems() from $what yields every item");
+    }
+
+    $book = new AddressBook();
+    $book->addPerson(person(1, 'Alice', array('555 0100')));
+    $book->addPerson(person(2, 'Bob'));
+    $n = 0;
+    foreach (AddressBook::iteratePerson(stream($book->serializeToString()), 3) as $person) {
+        checkSame($book->getPerson($n)->serializeToString(), $person->serializeToString(), "iteratePerson() yields person $n");
+        $n++;
+    }
+    checkSame(2, $n, 'iteratePerson() yields every person');
+});
+
+test('write stream appends the elements of a repeated field', function () {
+    $ints = range(-300, 300, 7);
+    $items = function () {
+        for ($i = 0; $i < 10; $i++) {
+            $item = new Bench\Item();
+            $item->setId($i);
+            $item->setName("item $i");
+            yield $item;
+        }
+    };
+    $wide = new Bench\Wide();
+    $wide->addNames('first');
+
+    $fp = fopen('php://memory', 'r+b');
+    $wide->write($fp);
+    checkSame(count($ints), Bench\Wide::writeIntsStream($fp, $ints, 16), 'writeIntsStream() counts the elements');
+    checkSame(3, Bench\Wide::writeDoublesStream($fp, array(0.5, -1.5, 2.0), 8), 'writeDoublesStream() counts the elements');
+    checkSame(2, Bench\Wide::writeIdsStream($fp, array(PHP_INT_MAX, 0), 1), 'writeIdsStream() counts the elements');
+    checkSame(10, Bench\Wide::writeItemsStream($fp, $items(), 16), 'writeItemsStream() counts the elements');
+    rewind($fp);
+    $bytes = stream_get_contents($fp);
+
+    foreach (decode('Bench\Wide', $bytes) as $path => $decoded) {
+        checkSame($ints, $decoded->getIntsArray(), "$path decodes ints written in several packed runs");
+        checkSame(array(0.5, -1.5, 2.0), $decoded->getDoublesArray(), "$path decodes doubles");
+        checkSame(array(PHP_INT_MAX, 0), $decoded->getIdsArray(), "$path decodes ids");
+        checkSame(array('first'), $decoded->getNamesArray(), "$path decodes names");
+        checkSame(10, $decoded->getItemsCount(), "$path decodes every item");
+        checkSame('item 9', $decoded->getItems(9)->getName(), "$path decodes the last item");
+    }
+
+    $people = array(person(1, 'Alice', array('555 0100')), person(2, 'Bob'));
+    $fp = fopen('php://memory', 'r+b');
+    checkSame(2, AddressBook::writePersonStream($fp, $people, 1), 'writePersonStream() counts the elements');
+    rewind($fp);
+    $book = new AddressBook();
+    $book->addAllPerson($people);
+    checkSame($book->serializeToString(), stream_get_contents($fp), 'writePersonStream() writes what serializeToString() does');
+
+    $record = new Test\Record();
+    $record->setPhoneNumber('555 0100');
+    $entries = array();
+    foreach (array(1 => 'first', 2 => 'second', 3 => 'third') as $id => $name) {
+        $entry = new Test\Entry();
+        $entry->setEntryId($id);
+        $entry->setEntryName($name);
+        $entries[] = $entry;
+    }
+    $fp = fopen('php://memory', 'r+b');
+    $record->write($fp);
+    checkSame(3, Test\Record::writeEntryStream($fp, $entries, 4), 'writeEntryStream() counts the elements');
+    rewind($fp);
+    $record->addAllEntry($entries);
+    checkSame($record->serializeToString(), stream_get_contents($fp), 'writeEntryStream() writes what serializeToString() does');
+});
+
+if ($failures) {
+    echo "$failures failures\n";
+    exit(1);
+}
+echo "All tests passed" . (extension_loaded('protobuf_primitives') ? ' with' : ' without') . " the protobuf_primitives extension\n";